@@ -0,0 +1,52 @@
+#!/bin/sh
+# Measures mkfs_adder throughput for large files, which go through the
+# single- and double-indirect block maps.
+#
+# Usage: ./bench_add.sh [file-size-mib ...]     (default: 1 4 16 64)
+# Environment: IMAGE_KIB  image size for mkfs_builder (default 81920)
+#              INODES     inode count for mkfs_builder (default 128)
+#
+# Each size is added to a freshly built image three times: writing a new
+# --output image, with --in-place, and with --in-place on an image built
+# with a metadata journal.
+set -eu
+
+cd "$(dirname "$0")"
+IMAGE_KIB=${IMAGE_KIB:-81920}
+INODES=${INODES:-128}
+[ $# -gt 0 ] || set -- 1 4 16 64
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c -o "$tmp/mkfs_builder"
+gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_adder.c -o "$tmp/mkfs_adder"
+
+now_ns() { date +%s%N; }
+
+printf '%-10s %-10s %12s %12s\n' "size_mib" "mode" "seconds" "MiB/s"
+for mib in "$@"; do
+    head -c $((mib * 1024 * 1024)) /dev/urandom > "$tmp/payload"
+
+    for mode in output in-place journal; do
+        journal=""
+        [ "$mode" = journal ] && journal="--journal-blocks 64"
+        # shellcheck disable=SC2086
+        "$tmp/mkfs_builder" --image "$tmp/base.img" --size-kib "$IMAGE_KIB" --inodes "$INODES" $journal > /dev/null
+        if [ "$mode" = output ]; then
+            target="--output out.img"
+        else
+            target="--in-place"
+        fi
+
+        start=$(now_ns)
+        # shellcheck disable=SC2086
+        (cd "$tmp" && ./mkfs_adder --input base.img $target --file payload > /dev/null)
+        end=$(now_ns)
+
+        awk -v mib="$mib" -v mode="$mode" -v ns=$((end - start)) 'BEGIN {
+            s = ns / 1e9
+            printf "%-10s %-10s %12.4f %12.1f\n", mib, mode, s, mib / s
+        }'
+    done
+done
@@ -0,0 +1,97 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench_build.c -o bench_build
+// Usage: ./bench_build [--builder <path>] [--dir <dir>] [size-kib ...]
+//        (default sizes: 4096 1048576 16777216, i.e. 4 MiB, 1 GiB, 16 GiB)
+//
+// Runs mkfs_builder for each size and reports wall time, the builder's peak
+// RSS and how much disk the image really occupies, to confirm that images
+// are created sparse.
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+extern char** environ;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char** argv) {
+    const char* builder = "./mkfs_builder";
+    const char* dir = ".";
+    uint64_t sizes[64];
+    int size_count = 0;
+
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--builder") == 0 && i + 1 < argc) {
+            builder = argv[++i];
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (size_count < 64) {
+            sizes[size_count++] = strtoull(argv[i], NULL, 10);
+        }
+    }
+    if (size_count == 0) {
+        sizes[size_count++] = 4096;
+        sizes[size_count++] = 1048576;
+        sizes[size_count++] = 16777216;
+    }
+
+    char image[4096];
+    snprintf(image, sizeof(image), "%s/bench_build.img", dir);
+
+    printf("%14s %10s %10s %12s %14s\n", "size_kib", "inodes", "seconds", "maxrss_kib", "disk_used_kib");
+    for (int s = 0; s < size_count; s++) {
+        // One inode per 16 KiB, within the builder's minimum
+        uint64_t inodes = sizes[s] / 16 < 128 ? 128 : sizes[s] / 16;
+        char size_arg[32], inode_arg[32];
+        snprintf(size_arg, sizeof(size_arg), "%llu", (unsigned long long)sizes[s]);
+        snprintf(inode_arg, sizeof(inode_arg), "%llu", (unsigned long long)inodes);
+
+        char* args[] = { (char*)builder, "--image", image, "--size-kib", size_arg,
+                         "--inodes", inode_arg, NULL };
+        posix_spawn_file_actions_t actions;
+        posix_spawn_file_actions_init(&actions);
+        posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, "/dev/null", O_WRONLY, 0);
+
+        double t0 = now_sec();
+        pid_t pid;
+        if (posix_spawn(&pid, builder, &actions, NULL, args, environ) != 0) {
+            perror("posix_spawn");
+            return 1;
+        }
+        int status;
+        struct rusage ru;
+        if (wait4(pid, &status, 0, &ru) < 0) {
+            perror("wait4");
+            return 1;
+        }
+        double dt = now_sec() - t0;
+        posix_spawn_file_actions_destroy(&actions);
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+            fprintf(stderr, "mkfs_builder failed for --size-kib %s\n", size_arg);
+            return 1;
+        }
+
+        struct stat st;
+        if (stat(image, &st) != 0) {
+            perror("stat");
+            return 1;
+        }
+        printf("%14s %10s %10.4f %12ld %14lld\n", size_arg, inode_arg, dt, ru.ru_maxrss,
+               (long long)st.st_blocks / 2);
+        unlink(image);
+    }
+    return 0;
+}
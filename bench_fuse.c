@@ -0,0 +1,247 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench_fuse.c -o bench_fuse
+// Usage: ./bench_fuse <dir> [--runtime <seconds>] [--bs <bytes>] [--direct]
+//
+// fio-style latency benchmark for an image mounted with minivsfs_fuse (or
+// any directory, for comparison). Collects the regular files under <dir>,
+// then runs each job for --runtime seconds (default 2) on one thread:
+//   stat      stat() of a random file
+//   randread  pread() of --bs bytes (default 4096) at a random --bs-aligned
+//             offset of a random file, through descriptors opened up front
+//   seqread   the files read front to back in --bs pieces, one after another
+// and reports IOPS, bandwidth and latency percentiles in microseconds. The
+// read jobs use as many of the files as the descriptor limit allows.
+//
+// minivsfs_fuse lets the kernel cache entries, attributes and pages, so
+// after the first pass the jobs measure those caches. --direct opens files
+// with O_DIRECT, which sends every read to the driver; --bs must then be a
+// multiple of 4096.
+#define _FILE_OFFSET_BITS 64
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+typedef struct {
+    char* path;
+    off_t size;
+    int fd;
+} bench_file_t;
+
+static bench_file_t* files;
+static size_t file_count, file_cap;
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64, fixed seed so runs pick the same files and offsets
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+static uint64_t next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int collect(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)ftw;
+    if (type != FTW_F || !S_ISREG(st->st_mode)) return 0;
+    if (file_count == file_cap) {
+        file_cap = file_cap ? file_cap * 2 : 1024;
+        bench_file_t* f = realloc(files, file_cap * sizeof(bench_file_t));
+        if (!f) return -1;
+        files = f;
+    }
+    files[file_count].path = strdup(path);
+    files[file_count].size = st->st_size;
+    files[file_count].fd = -1;
+    return files[file_count++].path ? 0 : -1;
+}
+
+// Latency samples of one job, in seconds
+typedef struct {
+    double* lat;
+    size_t count, cap;
+    uint64_t bytes;
+} job_t;
+
+static void record(job_t* j, double lat, size_t bytes) {
+    if (j->count == j->cap) {
+        j->cap = j->cap ? j->cap * 2 : 1 << 16;
+        double* p = realloc(j->lat, j->cap * sizeof(double));
+        if (!p) {
+            perror("realloc");
+            exit(1);
+        }
+        j->lat = p;
+    }
+    j->lat[j->count++] = lat;
+    j->bytes += bytes;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char* name, job_t* j, double runtime, size_t bs) {
+    if (j->count == 0) {
+        printf("%s: no I/O\n", name);
+        return;
+    }
+    qsort(j->lat, j->count, sizeof(double), cmp_double);
+    double sum = 0;
+    for (size_t i = 0; i < j->count; i++) sum += j->lat[i];
+#define PCT(p) (j->lat[(size_t)((p) / 100.0 * (j->count - 1))] * 1e6)
+    printf("%s: ", name);
+    if (bs) printf("bs=%zu ", bs);
+    printf("ios=%zu iops=%.0f", j->count, j->count / runtime);
+    if (bs) printf(" bw=%.1fMiB/s", j->bytes / runtime / (1 << 20));
+    printf("\n  lat (usec): min=%.2f avg=%.2f p50=%.2f p90=%.2f p99=%.2f p99.9=%.2f max=%.2f\n",
+           j->lat[0] * 1e6, sum / j->count * 1e6, PCT(50), PCT(90), PCT(99), PCT(99.9),
+           j->lat[j->count - 1] * 1e6);
+#undef PCT
+    free(j->lat);
+}
+
+int main(int argc, char** argv) {
+    if (argc < 2 || argv[1][0] == '-') {
+        fprintf(stderr, "Usage: %s <dir> [--runtime <seconds>] [--bs <bytes>] [--direct]\n", argv[0]);
+        return 1;
+    }
+    double runtime = 2;
+    size_t bs = 4096;
+    int direct = 0;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--direct") == 0) {
+            direct = 1;
+        } else if (strcmp(argv[i], "--runtime") == 0 && i + 1 < argc) {
+            runtime = strtod(argv[++i], NULL);
+        } else if (strcmp(argv[i], "--bs") == 0 && i + 1 < argc) {
+            bs = strtoull(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (runtime <= 0 || bs == 0 || (direct && bs % 4096 != 0)) {
+        fprintf(stderr, "Error: bad --runtime or --bs\n");
+        return 1;
+    }
+
+    if (nftw(argv[1], collect, 64, FTW_PHYS) != 0) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (file_count == 0) {
+        fprintf(stderr, "Error: no regular files under %s\n", argv[1]);
+        return 1;
+    }
+
+    // Read jobs keep one descriptor per file open
+    struct rlimit rl;
+    size_t open_count = file_count;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+        getrlimit(RLIMIT_NOFILE, &rl);
+        if (rl.rlim_cur != RLIM_INFINITY && rl.rlim_cur > 16 && open_count > rl.rlim_cur - 16) {
+            open_count = rl.rlim_cur - 16;
+        }
+    }
+    
+    uint64_t total = 0;
+    for (size_t i = 0; i < open_count; i++) {
+        files[i].fd = open(files[i].path, O_RDONLY | (direct ? O_DIRECT : 0));
+        if (files[i].fd < 0) {
+            perror(files[i].path);
+            return 1;
+        }
+        total += files[i].size;
+    }
+    void* buf;
+    if (posix_memalign(&buf, 4096, bs) != 0) {
+        perror("posix_memalign");
+        return 1;
+    }
+    printf("%zu files under %s, %zu read (%.1f MiB)%s\n", file_count, argv[1], open_count,
+           total / 1048576.0, direct ? " with O_DIRECT" : "");
+
+    job_t job = { 0 };
+    double t0 = now_sec(), t;
+    do {
+        struct stat st;
+        const bench_file_t* f = &files[next_rand() % file_count];
+        double s = now_sec();
+        if (stat(f->path, &st) != 0) {
+            perror(f->path);
+            return 1;
+        }
+        record(&job, (t = now_sec()) - s, 0);
+    } while (t - t0 < runtime);
+    report("stat", &job, t - t0, 0);
+
+    // Only files holding at least one aligned --bs piece take part
+    memset(&job, 0, sizeof(job));
+    size_t readable = 0;
+    for (size_t i = 0; i < open_count; i++) readable += files[i].size >= (off_t)bs;
+    if (readable > 0) {
+        t0 = now_sec();
+        do {
+            const bench_file_t* f;
+            do {
+                f = &files[next_rand() % open_count];
+            } while (f->size < (off_t)bs);
+            off_t off = (off_t)(next_rand() % (f->size / bs)) * bs;
+            double s = now_sec();
+            ssize_t n = pread(f->fd, buf, bs, off);
+            t = now_sec();
+            if (n < 0) {
+                perror(f->path);
+                return 1;
+            }
+            record(&job, t - s, n);
+        } while (t - t0 < runtime);
+    }
+    report("randread", &job, readable ? t - t0 : 1, bs);
+
+    memset(&job, 0, sizeof(job));
+    t0 = now_sec();
+    size_t k = 0;
+    off_t off = 0;
+    do {
+        const bench_file_t* f = &files[k];
+        double s = now_sec();
+        ssize_t n = pread(f->fd, buf, bs, off);
+        t = now_sec();
+        if (n < 0) {
+            perror(f->path);
+            return 1;
+        }
+        record(&job, t - s, n);
+        off += n;
+        if (n == 0 || off >= f->size) {
+            k = (k + 1) % open_count;
+            off = 0;
+        }
+    } while (t - t0 < runtime);
+    report("seqread", &job, t - t0, bs);
+
+    for (size_t i = 0; i < file_count; i++) {
+        if (files[i].fd >= 0) close(files[i].fd);
+        free(files[i].path);
+    }
+    free(files);
+    free(buf);
+    return 0;
+}
@@ -0,0 +1,204 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench_lz4.c -o bench_lz4
+// Usage: ./bench_lz4 [file ...]   (default: 4 MiB each of generated text,
+//                                  random bytes and zeros)
+//
+// Measures the lz4_block.h codec the way mkfs_adder --compress uses it:
+// each input is cut into 64 KiB chunks, and a chunk is kept raw unless
+// compressing saves at least one 4 KiB block. Reports the byte ratio, the
+// on-disk block ratio, compression MB/s and decode GB/s, after checking
+// that every chunk round-trips.
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "lz4_block.h"
+#include "minivsfs_format.h"
+
+#define GEN_BYTES (4u << 20)
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef struct {
+    const char* name;
+    uint8_t* data;
+    size_t size;
+} input_t;
+
+// Compressed chunks of one input, laid end to end
+typedef struct {
+    uint8_t* buf;
+    size_t* offset;         // chunk c starts at buf + offset[c]
+    size_t* clen;           // 0 if the chunk is kept raw
+    size_t chunks;
+    size_t bytes;           // compressed bytes of the compressed chunks
+    size_t stored_blocks;   // blocks mkfs_adder would write, chunk map excluded
+} packed_t;
+
+static size_t chunk_len(const input_t* in, size_t c) {
+    size_t left = in->size - c * CHUNK_BYTES;
+    return left < CHUNK_BYTES ? left : CHUNK_BYTES;
+}
+
+static void pack(const input_t* in, packed_t* p) {
+    size_t cap = lz4_bound(CHUNK_BYTES);
+    p->bytes = 0;
+    p->stored_blocks = 0;
+    for (size_t c = 0; c < p->chunks; c++) {
+        size_t len = chunk_len(in, c);
+        size_t n = lz4_compress(in->data + c * CHUNK_BYTES, len, p->buf + p->offset[c], cap);
+        size_t raw_blocks = (len + BS - 1) / BS;
+        if (n == 0 || (n + BS - 1) / BS >= raw_blocks) {
+            p->clen[c] = 0;
+            p->stored_blocks += raw_blocks;
+        } else {
+            p->clen[c] = n;
+            p->bytes += n;
+            p->stored_blocks += (n + BS - 1) / BS;
+        }
+    }
+}
+
+// Decode every compressed chunk; returns the number of bytes produced
+static size_t unpack(const input_t* in, const packed_t* p, uint8_t* out) {
+    size_t total = 0;
+    for (size_t c = 0; c < p->chunks; c++) {
+        if (p->clen[c] == 0) continue;
+        long n = lz4_decompress(p->buf + p->offset[c], p->clen[c], out + c * CHUNK_BYTES,
+                                chunk_len(in, c));
+        if (n < 0) return 0;
+        total += (size_t)n;
+    }
+    return total;
+}
+
+static void generate(input_t* in, const char* name, int kind) {
+    in->name = name;
+    in->size = GEN_BYTES;
+    in->data = malloc(in->size);
+    if (!in->data) {
+        perror("malloc");
+        exit(1);
+    }
+    uint64_t x = 0x9E3779B97F4A7C15ull;
+    size_t i = 0;
+    while (i < in->size) {
+        x ^= x << 13; x ^= x >> 7; x ^= x << 17;
+        if (kind == 0) {
+            // Words from a 512-entry vocabulary, like configs and source text
+            uint64_t w = (x >> 8) % 512;
+            size_t wl = 2 + w % 9;
+            for (size_t k = 0; k < wl && i < in->size; k++) in->data[i++] = 'a' + (w * 7 + k * 13) % 26;
+            if (i < in->size) in->data[i++] = (x & 0xF) == 0 ? '\n' : ' ';
+        } else {
+            in->data[i++] = kind == 1 ? (uint8_t)x : 0;
+        }
+    }
+}
+
+static int load(input_t* in, const char* path) {
+    FILE* fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    in->size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    in->name = path;
+    in->data = malloc(in->size ? in->size : 1);
+    if (!in->data || fread(in->data, 1, in->size, fp) != in->size) {
+        fprintf(stderr, "Error reading %s\n", path);
+        fclose(fp);
+        return -1;
+    }
+    fclose(fp);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    int count = argc > 1 ? argc - 1 : 3;
+    input_t* inputs = calloc(count, sizeof(input_t));
+    if (!inputs) {
+        perror("calloc");
+        return 1;
+    }
+    if (argc > 1) {
+        for (int i = 0; i < count; i++) {
+            if (load(&inputs[i], argv[i + 1]) != 0) return 1;
+        }
+    } else {
+        generate(&inputs[0], "text", 0);
+        generate(&inputs[1], "random", 1);
+        generate(&inputs[2], "zeros", 2);
+    }
+
+    printf("%-16s %12s %12s %8s %8s %12s %12s\n", "input", "bytes", "compressed", "ratio",
+           "blocks", "comp MB/s", "decode GB/s");
+    for (int i = 0; i < count; i++) {
+        const input_t* in = &inputs[i];
+        packed_t p = { 0 };
+        p.chunks = (in->size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+        p.buf = malloc(p.chunks * lz4_bound(CHUNK_BYTES) + 1);
+        p.offset = calloc(p.chunks + 1, sizeof(size_t));
+        p.clen = calloc(p.chunks + 1, sizeof(size_t));
+        uint8_t* out = malloc(in->size + 1);
+        if (!p.buf || !p.offset || !p.clen || !out) {
+            perror("malloc");
+            return 1;
+        }
+        for (size_t c = 0; c < p.chunks; c++) p.offset[c] = c * lz4_bound(CHUNK_BYTES);
+
+        // Compress until ~0.2 s has passed
+        size_t iters = 0;
+        double t0 = now_sec(), dt;
+        do {
+            pack(in, &p);
+            iters++;
+        } while ((dt = now_sec() - t0) < 0.2);
+        double comp_mbs = (double)in->size * iters / dt / 1e6;
+
+        // Round trip: decoded chunks must match, raw chunks are copied as is
+        memset(out, 0, in->size);
+        size_t decoded = unpack(in, &p, out);
+        for (size_t c = 0; c < p.chunks; c++) {
+            if (p.clen[c] == 0) memcpy(out + c * CHUNK_BYTES, in->data + c * CHUNK_BYTES, chunk_len(in, c));
+        }
+        if (memcmp(out, in->data, in->size) != 0) {
+            fprintf(stderr, "MISMATCH %s: round trip differs\n", in->name);
+            return 1;
+        }
+
+        // Decode throughput counts decoded (uncompressed) bytes
+        double decode_gbs = 0;
+        if (decoded > 0) {
+            iters = 0;
+            t0 = now_sec();
+            do {
+                unpack(in, &p, out);
+                iters++;
+            } while ((dt = now_sec() - t0) < 0.2);
+            decode_gbs = (double)decoded * iters / dt / 1e9;
+        }
+
+        size_t raw_blocks = (in->size + BS - 1) / BS;
+        // ratio covers the chunks that compressed; blocks covers the whole input
+        printf("%-16s %12zu %12zu %8.2f %8.2f %12.1f %12.2f\n", in->name, in->size, p.bytes,
+               decoded ? (double)decoded / p.bytes : 1.0,
+               p.stored_blocks ? (double)raw_blocks / p.stored_blocks : 1.0, comp_mbs, decode_gbs);
+
+        free(p.buf);
+        free(p.offset);
+        free(p.clen);
+        free(out);
+        free(in->data);
+    }
+    free(inputs);
+    return 0;
+}
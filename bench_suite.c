@@ -0,0 +1,446 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra bench_suite.c minivsfs.c -o bench_suite
+// Usage: ./bench_suite [--bin <dir>] [--dir <dir>] [--samples <n>] [--large-mib <n>]
+//                      [--output <file>]
+//
+// Regression benchmark for the MiniVSFS tools, with results as one JSON
+// object (on stdout, or in --output) so runs can be compared across
+// releases; bench_suite.sh builds everything and writes bench_output.txt.
+// The tools are run from --bin (default "."); file sets and images go to a
+// temporary directory under --dir (default "."), removed at the end.
+//
+//   crc32     crc32() MB/s over an inode (120 B), a superblock (4092 B) and
+//             16 MiB, with the engine picked for this CPU
+//   build     mkfs_builder wall time and peak RSS for a 1 GiB image
+//
+// and for each synthetic file set:
+//   tiny      2000 files of 0..1024 bytes
+//   large     4 files of --large-mib MiB (default 64), deep in the
+//             double-indirect map; the format's limit is 4 GiB + 4 MiB + 48 KiB
+//   mixed     600 files, sizes log-uniform from 1 byte to 8 MiB
+// it measures
+//   batch_add  one mkfs_adder --tree run over the whole set: files/s, MiB/s
+//   file_add   --samples (default 100) runs of mkfs_adder --in-place --file,
+//              one file each, as a user adding files one at a time sees
+//              them: p50/p99/max latency including process start-up
+//   lookup     mvfs_lookup() of every name of the batch image, per second
+//   verify     mkfs_check of the batch image
+// Every spawned tool reports its peak RSS. File contents are pseudo-random
+// from a fixed seed, so runs see the same bytes.
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <time.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/utsname.h>
+
+#include "minivsfs.h"
+
+#define FILES_PER_DIR 500       // a directory holds 12 blocks of 64 dirents
+#define PATH_BUF 4096
+
+static double now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// xorshift64, fixed seed so every run writes the same files
+static uint64_t rng = 0x9E3779B97F4A7C15ull;
+static uint64_t next_rand(void) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static int cmp_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// "dir/name" into dst (PATH_BUF bytes)
+static char* path_join(char* dst, const char* dir, const char* name) {
+    if (snprintf(dst, PATH_BUF, "%s/%s", dir, name) >= PATH_BUF) {
+        fprintf(stderr, "Error: path too long: %s/%s\n", dir, name);
+        exit(1);
+    }
+    return dst;
+}
+
+// Run a tool with stdout discarded; wall seconds and peak RSS (KiB) out.
+// Returns the exit status, or -1 if it could not be run. fork() rather than
+// posix_spawn(): a vfork'd child's peak RSS starts at the parent's peak,
+// a forked one's at the parent's current RSS, which is kept small.
+static int run(char* const* args, double* seconds, long* maxrss_kib) {
+    double t0 = now_sec();
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, STDOUT_FILENO);
+        execv(args[0], args);
+        perror(args[0]);
+        _exit(127);
+    }
+    int status;
+    struct rusage ru;
+    if (wait4(pid, &status, 0, &ru) < 0) {
+        perror("wait4");
+        return -1;
+    }
+    *seconds = now_sec() - t0;
+    *maxrss_kib = ru.ru_maxrss;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        fprintf(stderr, "%s failed\n", args[0]);
+        return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+    }
+    return 0;
+}
+
+typedef struct {
+    const char* name;
+    char** paths;               // relative to the set's directory
+    uint64_t* sizes;
+    size_t count;
+    uint64_t bytes;
+} file_set_t;
+
+// Write "size" pseudo-random bytes to "path"
+static int write_file(const char* path, uint64_t size, uint8_t* buf, size_t buf_size) {
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror(path);
+        return -1;
+    }
+    while (size > 0) {
+        size_t n = size < buf_size ? size : buf_size;
+        for (size_t i = 0; i < n; i += 8) {
+            uint64_t r = next_rand();
+            memcpy(buf + i, &r, n - i < 8 ? n - i : 8);
+        }
+        if (write(fd, buf, n) != (ssize_t)n) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+        size -= n;
+    }
+    return close(fd);
+}
+
+// Create set->count files of set->sizes[] bytes under "root/<name>", in
+// subdirectories of FILES_PER_DIR
+static int make_set(file_set_t* set, const char* root) {
+    char set_dir[PATH_BUF], path[PATH_BUF];
+    path_join(set_dir, root, set->name);
+    size_t buf_size = 1 << 20;
+    uint8_t* buf = malloc(buf_size);
+    set->paths = calloc(set->count, sizeof(char*));
+    if (!buf || !set->paths || mkdir(set_dir, 0755) != 0) {
+        perror(set_dir);
+        free(buf);
+        return -1;
+    }
+    int rc = 0;
+    for (size_t i = 0; i < set->count && rc == 0; i++) {
+        char rel[48];
+        snprintf(rel, sizeof(rel), "%02zu/%05zu", i / FILES_PER_DIR, i);
+        if (i % FILES_PER_DIR == 0) {
+            rel[2] = '\0';
+            if (mkdir(path_join(path, set_dir, rel), 0755) != 0) {
+                perror(path);
+                rc = -1;
+                break;
+            }
+            rel[2] = '/';
+        }
+        set->paths[i] = strdup(rel);
+        rc = set->paths[i] ? write_file(path_join(path, set_dir, rel), set->sizes[i], buf, buf_size) : -1;
+        set->bytes += set->sizes[i];
+    }
+    free(buf);
+    return rc;
+}
+
+// Image big enough for the set twice over (batch image plus the file_add
+// samples, with pointer blocks) and one inode per file
+static void image_args(const file_set_t* set, char* size_kib, char* inodes) {
+    uint64_t blocks = 0;
+    for (size_t i = 0; i < set->count; i++) {
+        uint64_t b = (set->sizes[i] + BS - 1) / BS;
+        blocks += b + (b > DIRECT_MAX ? 2 + b / PTRS_PER_BLOCK : 0);
+    }
+    uint64_t kib = (blocks * 2 + 1024) * (BS / 1024);
+    sprintf(size_kib, "%llu", (unsigned long long)(kib < 4096 ? 4096 : kib));
+    sprintf(inodes, "%llu", (unsigned long long)(set->count * 2 + 128));
+}
+
+static int remove_entry(const char* path, const struct stat* st, int type, struct FTW* ftw) {
+    (void)st;
+    (void)ftw;
+    return type == FTW_DP ? rmdir(path) : unlink(path);
+}
+
+static double crc32_mbps(const uint8_t* buf, size_t n) {
+    volatile uint32_t sink = 0;
+    size_t iters = 1;
+    for (;;) {
+        double t0 = now_sec();
+        for (size_t i = 0; i < iters; i++) sink ^= crc32(buf, n);
+        double dt = now_sec() - t0;
+        if (dt > 0.2) return (double)n * iters / dt / 1e6;
+        iters *= 2;
+    }
+}
+
+// Benchmark one file set; its JSON object goes to "out"
+static int bench_set(FILE* out, file_set_t* set, const char* bin, const char* root, size_t samples) {
+    char builder[PATH_BUF], adder[PATH_BUF], checker[PATH_BUF], image[PATH_BUF], set_dir[PATH_BUF];
+    path_join(builder, bin, "mkfs_builder");
+    path_join(adder, bin, "mkfs_adder");
+    path_join(checker, bin, "mkfs_check");
+    path_join(set_dir, root, set->name);
+    path_join(image, root, "set.img");
+    char size_kib[32], inodes[32];
+    image_args(set, size_kib, inodes);
+    char* build_args[] = { builder, "--image", image, "--size-kib", size_kib, "--inodes", inodes,
+                           "--epoch", "0", NULL };
+    double seconds;
+    long rss;
+
+    // batch_add
+    if (run(build_args, &seconds, &rss) != 0) return -1;
+    char* tree_args[] = { adder, "--input", image, "--in-place", "--tree", set_dir, "--epoch", "0", NULL };
+    double batch_seconds;
+    long batch_rss;
+    if (run(tree_args, &batch_seconds, &batch_rss) != 0) return -1;
+
+    // lookup, on the batch image
+    mvfs_image_t* img;
+    int err = mvfs_open(image, &img);
+    if (err != 0) {
+        fprintf(stderr, "%s: %s\n", image, strerror(-err));
+        return -1;
+    }
+    uint64_t lookups = 0;
+    double t0 = now_sec(), lookup_seconds;
+    do {
+        for (size_t i = 0; i < set->count; i++, lookups++) {
+            uint32_t ino;
+            if (mvfs_lookup(img, set->paths[i], &ino) != 0) {
+                fprintf(stderr, "%s: lookup of %s failed\n", image, set->paths[i]);
+                mvfs_close(img);
+                return -1;
+            }
+        }
+    } while ((lookup_seconds = now_sec() - t0) < 0.2);
+    mvfs_close(img);
+
+    // verify
+    char* check_args[] = { checker, "--image", image, NULL };
+    double check_seconds;
+    long check_rss;
+    if (run(check_args, &check_seconds, &check_rss) != 0) return -1;
+
+    // file_add: evenly spaced samples into the same image, named by their
+    // path below root so they do not collide with the batch
+    if (samples > set->count) samples = set->count;
+    double* lat = malloc((samples ? samples : 1) * sizeof(double));
+    if (!lat) return -1;
+    long add_rss = 0;
+    char cwd[PATH_BUF];
+    if (!getcwd(cwd, sizeof(cwd)) || chdir(root) != 0) {
+        perror("chdir");
+        free(lat);
+        return -1;
+    }
+    int rc = 0;
+    for (size_t s = 0; s < samples && rc == 0; s++) {
+        char file[PATH_BUF];
+        path_join(file, set->name, set->paths[s * set->count / samples]);
+        char* add_args[] = { adder, "--input", image, "--in-place", "--file", file, "--epoch", "0", NULL };
+        rc = run(add_args, &lat[s], &rss);
+        if (rss > add_rss) add_rss = rss;
+    }
+    if (chdir(cwd) != 0 || rc != 0) {
+        free(lat);
+        return -1;
+    }
+    qsort(lat, samples, sizeof(double), cmp_double);
+#define PCT(p) (samples ? lat[(size_t)((p) / 100.0 * (samples - 1))] * 1e3 : 0)
+
+    fprintf(out, "    {\n");
+    fprintf(out, "      \"name\": \"%s\",\n", set->name);
+    fprintf(out, "      \"files\": %zu,\n", set->count);
+    fprintf(out, "      \"bytes\": %llu,\n", (unsigned long long)set->bytes);
+    fprintf(out, "      \"image_kib\": %s,\n", size_kib);
+    fprintf(out, "      \"batch_add\": { \"seconds\": %.4f, \"files_per_sec\": %.1f, \"mib_per_sec\": %.1f, "
+                 "\"peak_rss_kib\": %ld },\n",
+            batch_seconds, set->count / batch_seconds, set->bytes / batch_seconds / (1 << 20), batch_rss);
+    fprintf(out, "      \"file_add\": { \"samples\": %zu, \"p50_ms\": %.3f, \"p99_ms\": %.3f, \"max_ms\": %.3f, "
+                 "\"peak_rss_kib\": %ld },\n",
+            samples, PCT(50), PCT(99), PCT(100), add_rss);
+    fprintf(out, "      \"lookup\": { \"lookups\": %llu, \"per_sec\": %.0f },\n",
+            (unsigned long long)lookups, lookups / lookup_seconds);
+    fprintf(out, "      \"verify\": { \"seconds\": %.4f, \"peak_rss_kib\": %ld }\n", check_seconds, check_rss);
+    fprintf(out, "    }");
+#undef PCT
+    free(lat);
+    unlink(image);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* bin = ".";
+    const char* dir = ".";
+    const char* output = NULL;
+    size_t samples = 100;
+    uint64_t large_mib = 64;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bin") == 0 && i + 1 < argc) {
+            bin = argv[++i];
+        } else if (strcmp(argv[i], "--dir") == 0 && i + 1 < argc) {
+            dir = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output = argv[++i];
+        } else if (strcmp(argv[i], "--samples") == 0 && i + 1 < argc) {
+            samples = strtoull(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--large-mib") == 0 && i + 1 < argc) {
+            large_mib = strtoull(argv[++i], NULL, 10);
+        } else {
+            fprintf(stderr, "Usage: %s [--bin <dir>] [--dir <dir>] [--samples <n>] [--large-mib <n>]\n"
+                            "          [--output <file>]\n", argv[0]);
+            return 1;
+        }
+    }
+    if (large_mib == 0 || large_mib > 4096) {
+        fprintf(stderr, "Error: --large-mib must be between 1 and 4096\n");
+        return 1;
+    }
+
+    // The tools are spawned from inside the work directory too
+    char bin_abs[PATH_MAX], root[PATH_BUF];
+    if (!realpath(bin, bin_abs)) {
+        perror(bin);
+        return 1;
+    }
+    if (!mkdtemp(path_join(root, dir, "bench_suite.XXXXXX"))) {
+        perror("mkdtemp");
+        return 1;
+    }
+    char root_abs[PATH_MAX];
+    if (!realpath(root, root_abs)) {
+        perror(root);
+        return 1;
+    }
+
+    // Sets
+    enum { TINY, LARGE, MIXED, SET_COUNT };
+    file_set_t sets[SET_COUNT] = {
+        [TINY] = { .name = "tiny", .count = 2000 },
+        [LARGE] = { .name = "large", .count = 4 },
+        [MIXED] = { .name = "mixed", .count = 600 },
+    };
+    int rc = 1;
+    FILE* out = NULL;
+    for (int s = 0; s < SET_COUNT; s++) {
+        sets[s].sizes = malloc(sets[s].count * sizeof(uint64_t));
+        if (!sets[s].sizes) {
+            perror("malloc");
+            goto out;
+        }
+        for (size_t i = 0; i < sets[s].count; i++) {
+            uint64_t size;
+            if (s == TINY) {
+                size = next_rand() % 1025;
+            } else if (s == LARGE) {
+                size = large_mib << 20;
+            } else {
+                // 2^(0..23) scaled by a random mantissa
+                size = (uint64_t)((double)(1ull << (next_rand() % 23)) * (1 + (next_rand() % 1000) / 1000.0));
+            }
+            sets[s].sizes[i] = size;
+        }
+        if (make_set(&sets[s], root_abs) != 0) goto out;
+    }
+
+    out = output ? fopen(output, "w") : stdout;
+    if (!out) {
+        perror(output);
+        goto out;
+    }
+
+    struct utsname uts;
+    uname(&uts);
+    fprintf(out, "{\n");
+    fprintf(out, "  \"schema\": 1,\n");
+    fprintf(out, "  \"unix_time\": %lld,\n", (long long)time(NULL));
+    fprintf(out, "  \"host\": { \"machine\": \"%s\", \"cpus\": %ld },\n", uts.machine,
+            sysconf(_SC_NPROCESSORS_ONLN));
+
+    // crc32
+    size_t crc_bytes = 16u << 20;
+    uint8_t* crc_buf = malloc(crc_bytes);
+    if (!crc_buf) {
+        perror("malloc");
+        goto out;
+    }
+    for (size_t i = 0; i < crc_bytes; i++) crc_buf[i] = (uint8_t)next_rand();
+    const char* engine = "slice8";
+#ifdef CRC32_HAVE_PCLMUL
+    if (crc32_best_update() == crc32_pclmul_update) engine = "pclmul";
+#endif
+    fprintf(out, "  \"crc32\": { \"engine\": \"%s\", \"inode_mbps\": %.1f, \"superblock_mbps\": %.1f, "
+                 "\"bulk_mbps\": %.1f },\n",
+            engine, crc32_mbps(crc_buf, INODE_CRC_BYTES), crc32_mbps(crc_buf, BS - 4),
+            crc32_mbps(crc_buf, crc_bytes));
+    free(crc_buf);
+
+    // build
+    char builder[PATH_BUF], image[PATH_BUF];
+    path_join(builder, bin_abs, "mkfs_builder");
+    path_join(image, root_abs, "build.img");
+    char* build_args[] = { builder, "--image", image, "--size-kib", "1048576", "--inodes", "65536",
+                           "--epoch", "0", NULL };
+    double seconds;
+    long rss;
+    if (run(build_args, &seconds, &rss) != 0) goto out;
+    unlink(image);
+    fprintf(out, "  \"build\": { \"size_kib\": 1048576, \"inodes\": 65536, \"seconds\": %.4f, "
+                 "\"peak_rss_kib\": %ld },\n", seconds, rss);
+
+    fprintf(out, "  \"sets\": [\n");
+    for (int s = 0; s < SET_COUNT; s++) {
+        fprintf(stderr, "bench_suite: %s set\n", sets[s].name);
+        if (bench_set(out, &sets[s], bin_abs, root_abs, samples) != 0) goto out;
+        fprintf(out, s + 1 < SET_COUNT ? ",\n" : "\n");
+    }
+    fprintf(out, "  ]\n}\n");
+    rc = 0;
+
+out:
+    if (out && out != stdout && fclose(out) != 0) {
+        perror(output);
+        rc = 1;
+    }
+    for (int s = 0; s < SET_COUNT; s++) {
+        for (size_t i = 0; sets[s].paths && i < sets[s].count; i++) free(sets[s].paths[i]);
+        free(sets[s].paths);
+        free(sets[s].sizes);
+    }
+    nftw(root_abs, remove_entry, 64, FTW_DEPTH | FTW_PHYS);
+    return rc;
+}
@@ -0,0 +1,21 @@
+#!/bin/sh
+# Builds the tools and bench_suite with the same flags as their Build:
+# lines and runs the suite, leaving the JSON results in bench_output.txt.
+#
+# Usage: ./bench_suite.sh [bench_suite options]   (see bench_suite.c)
+# Environment: BENCH_OUTPUT  where to write the results (default bench_output.txt)
+set -eu
+
+cd "$(dirname "$0")"
+BENCH_OUTPUT=${BENCH_OUTPUT:-bench_output.txt}
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c -o "$tmp/mkfs_builder"
+gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_adder.c -o "$tmp/mkfs_adder"
+gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_check.c -o "$tmp/mkfs_check"
+gcc -O2 -std=c17 -Wall -Wextra bench_suite.c minivsfs.c -o "$tmp/bench_suite"
+
+"$tmp/bench_suite" --bin "$tmp" --dir "$tmp" --output "$BENCH_OUTPUT" "$@"
+echo "Results in $BENCH_OUTPUT"
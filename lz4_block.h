@@ -0,0 +1,175 @@
+// LZ4 block format codec used for compressed MiniVSFS file data. Header-only
+// so each tool still builds from one command.
+//
+// The output is a standard LZ4 block (no frame header): a run of sequences,
+// each a token byte (literal length << 4 | match length - 4), optional
+// length extension bytes, the literals and a 16-bit little-endian match
+// offset. The compressor is the greedy single-probe variant with a 4 KiB
+// hash table, which trades some ratio for speed; the decoder bounds-checks
+// every read and write, so corrupt images cannot make it overrun.
+#ifndef MINIVSFS_LZ4_BLOCK_H
+#define MINIVSFS_LZ4_BLOCK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH 4
+#define LZ4_LAST_LITERALS 5     // a block always ends with this many literals
+#define LZ4_MFLIMIT 12          // no match may start in the last 12 bytes
+#define LZ4_MAX_OFFSET 65535
+#define LZ4_HASH_BITS 12
+
+// Worst-case compressed size of n bytes
+static inline size_t lz4_bound(size_t n){
+    return n + n / 255 + 16;
+}
+
+static inline uint32_t lz4_read32(const uint8_t* p){
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+static inline uint32_t lz4_hash(uint32_t v){
+    return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Append a length that did not fit in its 4-bit token field
+static inline uint8_t* lz4_put_length(uint8_t* op, size_t len){
+    while (len >= 255) {
+        *op++ = 255;
+        len -= 255;
+    }
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Compress src[0..n) into dst. Returns the compressed size, or 0 if it does
+// not fit in cap bytes.
+static inline size_t lz4_compress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap){
+    uint32_t table[1u << LZ4_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    const uint8_t* ip = src;
+    const uint8_t* anchor = src;
+    const uint8_t* end = src + n;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    if (n > LZ4_MFLIMIT) {
+        const uint8_t* mflimit = end - LZ4_MFLIMIT;
+        const uint8_t* matchlimit = end - LZ4_LAST_LITERALS;
+        while (ip < mflimit) {
+            uint32_t h = lz4_hash(lz4_read32(ip));
+            const uint8_t* ref = src + table[h];
+            table[h] = (uint32_t)(ip - src);
+            if (ref >= ip || ip - ref > LZ4_MAX_OFFSET || lz4_read32(ref) != lz4_read32(ip)) {
+                ip++;
+                continue;
+            }
+
+            // Grow the match backwards over pending literals, then forwards
+            while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+                ip--;
+                ref--;
+            }
+            const uint8_t* mp = ip + LZ4_MIN_MATCH;
+            const uint8_t* rp = ref + LZ4_MIN_MATCH;
+            while (mp < matchlimit && *mp == *rp) {
+                mp++;
+                rp++;
+            }
+
+            size_t lit = (size_t)(ip - anchor);
+            size_t mlen = (size_t)(mp - ip) - LZ4_MIN_MATCH;
+            if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit + 2 + mlen / 255 + 1) return 0;
+
+            uint8_t* token = op++;
+            *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+            if (lit >= 15) op = lz4_put_length(op, lit - 15);
+            memcpy(op, anchor, lit);
+            op += lit;
+            size_t off = (size_t)(ip - ref);
+            *op++ = (uint8_t)off;
+            *op++ = (uint8_t)(off >> 8);
+            *token |= (uint8_t)(mlen >= 15 ? 15 : mlen);
+            if (mlen >= 15) op = lz4_put_length(op, mlen - 15);
+
+            ip = mp;
+            anchor = ip;
+        }
+    }
+
+    // Final literals-only sequence
+    size_t lit = (size_t)(end - anchor);
+    if ((size_t)(oend - op) < 1 + lit / 255 + 1 + lit) return 0;
+    uint8_t* token = op++;
+    *token = (uint8_t)((lit >= 15 ? 15 : lit) << 4);
+    if (lit >= 15) op = lz4_put_length(op, lit - 15);
+    memcpy(op, anchor, lit);
+    op += lit;
+    return (size_t)(op - dst);
+}
+
+// Decompress an LZ4 block into dst. Returns the decompressed size, or -1 if
+// the input is malformed or would write past cap bytes.
+static inline long lz4_decompress(const uint8_t* src, size_t n, uint8_t* dst, size_t cap){
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + n;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + cap;
+
+    while (ip < iend) {
+        unsigned token = *ip++;
+
+        size_t lit = token >> 4;
+        if (lit == 15) {
+            uint8_t b;
+            do {
+                if (ip == iend) return -1;
+                b = *ip++;
+                lit += b;
+            } while (b == 255);
+        }
+        if (lit > (size_t)(iend - ip) || lit > (size_t)(oend - op)) return -1;
+        memcpy(op, ip, lit);
+        op += lit;
+        ip += lit;
+        if (ip == iend) break;      // the last sequence has no match
+
+        if (iend - ip < 2) return -1;
+        size_t off = ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        if (off == 0 || off > (size_t)(op - dst)) return -1;
+
+        size_t mlen = token & 15;
+        if (mlen == 15) {
+            uint8_t b;
+            do {
+                if (ip == iend) return -1;
+                b = *ip++;
+                mlen += b;
+            } while (b == 255);
+        }
+        mlen += LZ4_MIN_MATCH;
+        if (mlen > (size_t)(oend - op)) return -1;
+
+        // The match may overlap its own output (off < mlen repeats a
+        // pattern); copy in steps no longer than the offset
+        const uint8_t* ref = op - off;
+        if (off >= mlen) {
+            memcpy(op, ref, mlen);
+        } else if (off >= 8) {
+            size_t i = 0;
+            for (; i + 8 <= mlen; i += 8) memcpy(op + i, ref + i, 8);
+            for (; i < mlen; i++) op[i] = ref[i];
+        } else {
+            for (size_t i = 0; i < mlen; i++) op[i] = ref[i];
+        }
+        op += mlen;
+    }
+    return (long)(op - dst);
+}
+
+#endif // MINIVSFS_LZ4_BLOCK_H
@@ -0,0 +1,384 @@
+// libminivsfs: read-only MiniVSFS image access. See minivsfs.h.
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "lz4_block.h"
+#include "minivsfs.h"
+
+struct mvfs_image {
+    const uint8_t* base;
+    size_t size;
+    const superblock_t* sb;
+    const inode_t* inode_table;
+    const dirent64_t** names;   // open-addressing index over root dirents
+    size_t names_cap;           // power of two
+};
+
+// FNV-1a over the NUL-terminated name
+static uint32_t name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (const uint8_t* p = (const uint8_t*)name; *p; p++) h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+static const inode_t* inode_at(const mvfs_image_t* img, uint32_t ino) {
+    if (ino == 0 || ino > img->sb->inode_count) return NULL;
+    return &img->inode_table[ino - 1];
+}
+
+// Block pointers must land inside the data region
+static int valid_block(const mvfs_image_t* img, uint32_t block) {
+    return block >= img->sb->data_region_start && block < img->sb->total_blocks;
+}
+
+// Physical block backing logical block "i" of an inode, 0 if unmapped
+static uint32_t file_block(const mvfs_image_t* img, const inode_t* inode, uint64_t i) {
+    if (i < DIRECT_MAX) return inode->direct[i];
+    i -= DIRECT_MAX;
+
+    const uint32_t* map;
+    if (i < PTRS_PER_BLOCK) {
+        if (!valid_block(img, inode->indirect)) return 0;
+        map = (const uint32_t*)block_ptr(img->base, inode->indirect);
+        return map[i];
+    }
+    i -= PTRS_PER_BLOCK;
+    if (i >= (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK) return 0;
+    if (!valid_block(img, inode->double_indirect)) return 0;
+    map = (const uint32_t*)block_ptr(img->base, inode->double_indirect);
+    uint32_t l2 = map[i / PTRS_PER_BLOCK];
+    if (!valid_block(img, l2)) return 0;
+    map = (const uint32_t*)block_ptr(img->base, l2);
+    return map[i % PTRS_PER_BLOCK];
+}
+
+// Index the root directory's dirents by name
+static int index_root(mvfs_image_t* img) {
+    const inode_t* root = inode_at(img, ROOT_INO);
+    size_t count = 0;
+    for (int k = 0; k < DIRECT_MAX; k++) {
+        if (root->direct[k] != 0 && !valid_block(img, root->direct[k])) return -EINVAL;
+        if (root->direct[k] != 0) count += BS / sizeof(dirent64_t);
+    }
+
+    size_t cap = 16;
+    while (cap < count * 2) cap *= 2;
+    img->names = calloc(cap, sizeof(*img->names));
+    if (!img->names) return -ENOMEM;
+    img->names_cap = cap;
+
+    for (int k = 0; k < DIRECT_MAX; k++) {
+        if (root->direct[k] == 0) continue;
+        const dirent64_t* de = (const dirent64_t*)block_ptr(img->base, root->direct[k]);
+        for (size_t e = 0; e < BS / sizeof(dirent64_t); e++, de++) {
+            if (de->inode_no == 0 || memchr(de->name, '\0', sizeof(de->name)) == NULL) continue;
+            size_t b = name_hash(de->name) & (cap - 1);
+            while (img->names[b] != NULL) b = (b + 1) & (cap - 1);
+            img->names[b] = de;
+        }
+    }
+    return 0;
+}
+
+int mvfs_open(const char* path, mvfs_image_t** out) {
+    *out = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -errno;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        int err = -errno;
+        close(fd);
+        return err;
+    }
+    if (st.st_size < (off_t)BS) {
+        close(fd);
+        return -EINVAL;
+    }
+
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    int err = base == MAP_FAILED ? -errno : 0;
+    close(fd);
+    if (err) return err;
+
+    mvfs_image_t* img = calloc(1, sizeof(*img));
+    if (!img) {
+        munmap(base, st.st_size);
+        return -ENOMEM;
+    }
+    img->base = base;
+    img->size = st.st_size;
+    img->sb = (const superblock_t*)base;
+
+    const superblock_t* sb = img->sb;
+    if (!superblock_layout_ok(sb, img->size / BS)) {
+        err = -EINVAL;
+    } else if (superblock_crc(img->base) != sb->checksum) {
+        err = -EIO;
+    } else if (sb->flags & ~SB_KNOWN_FLAGS) {
+        err = -ENOTSUP;
+    } else if (sb->flags & SB_FLAG_JOURNAL) {
+        // Until a pending transaction is checkpointed the image may be half
+        // updated; the library maps read-only and cannot replay it
+        const journal_header_t* jh = (const journal_header_t*)block_ptr(img->base, sb->journal_start);
+        if (jh->magic == JOURNAL_MAGIC && jh->count != 0) err = -EBUSY;
+    }
+    if (!err) {
+        img->inode_table = (const inode_t*)block_ptr(img->base, sb->inode_table_start);
+        err = index_root(img);
+    }
+    if (err) {
+        mvfs_close(img);
+        return err;
+    }
+
+    *out = img;
+    return 0;
+}
+
+void mvfs_close(mvfs_image_t* img) {
+    if (!img) return;
+    munmap((void*)img->base, img->size);
+    free(img->names);
+    free(img);
+}
+
+const superblock_t* mvfs_superblock(const mvfs_image_t* img) {
+    return img->sb;
+}
+
+// Root entries come from the index; deeper directories are scanned, as they
+// are only reached through paths
+static int lookup_in(const mvfs_image_t* img, uint32_t dir, const char* name, size_t len,
+                     uint32_t* ino) {
+    if (len >= sizeof(((dirent64_t*)0)->name)) return -ENOENT;
+    if (dir == ROOT_INO) {
+        char key[sizeof(((dirent64_t*)0)->name)];
+        memcpy(key, name, len);
+        key[len] = '\0';
+        size_t mask = img->names_cap - 1;
+        for (size_t b = name_hash(key) & mask; img->names[b] != NULL; b = (b + 1) & mask) {
+            if (strcmp(img->names[b]->name, key) == 0) {
+                *ino = img->names[b]->inode_no;
+                return 0;
+            }
+        }
+        return -ENOENT;
+    }
+
+    const inode_t* inode = inode_at(img, dir);
+    if (!inode) return -ENOENT;
+    if (inode->mode != 0040000) return -ENOTDIR;
+    for (int k = 0; k < DIRECT_MAX; k++) {
+        if (inode->direct[k] == 0 || !valid_block(img, inode->direct[k])) continue;
+        const dirent64_t* de = (const dirent64_t*)block_ptr(img->base, inode->direct[k]);
+        for (size_t e = 0; e < BS / sizeof(dirent64_t); e++, de++) {
+            if (de->inode_no != 0 && strncmp(de->name, name, len) == 0 && de->name[len] == '\0') {
+                *ino = de->inode_no;
+                return 0;
+            }
+        }
+    }
+    return -ENOENT;
+}
+
+int mvfs_lookup(const mvfs_image_t* img, const char* path, uint32_t* ino) {
+    // mkfs_adder --file keeps the host path, slashes included, as the name
+    if (lookup_in(img, ROOT_INO, path, strlen(path), ino) == 0) return 0;
+
+    uint32_t cur = ROOT_INO;
+    while (*path == '/') path++;
+    while (*path) {
+        size_t len = strcspn(path, "/");
+        int err = lookup_in(img, cur, path, len, &cur);
+        if (err) return err;
+        path += len;
+        while (*path == '/') path++;
+    }
+    *ino = cur;
+    return 0;
+}
+
+int mvfs_readdir(const mvfs_image_t* img, uint32_t dir, uint64_t* pos, mvfs_dirent_t* ent) {
+    const inode_t* inode = inode_at(img, dir);
+    if (!inode) return -ENOENT;
+    if (inode->mode != 0040000) return -ENOTDIR;
+
+    const uint64_t per_block = BS / sizeof(dirent64_t);
+    while (*pos < DIRECT_MAX * per_block) {
+        uint32_t block = inode->direct[*pos / per_block];
+        if (block == 0 || !valid_block(img, block)) {
+            *pos = (*pos / per_block + 1) * per_block;
+            continue;
+        }
+        const dirent64_t* de = (const dirent64_t*)block_ptr(img->base, block) + *pos % per_block;
+        (*pos)++;
+        if (de->inode_no == 0 || memchr(de->name, '\0', sizeof(de->name)) == NULL) continue;
+        ent->ino = de->inode_no;
+        ent->type = de->type;
+        memcpy(ent->name, de->name, sizeof(ent->name));
+        return 1;
+    }
+    return 0;
+}
+
+int mvfs_stat(const mvfs_image_t* img, uint32_t ino, mvfs_stat_t* st) {
+    const inode_t* inode = inode_at(img, ino);
+    if (!inode) return -ENOENT;
+    if (inode_crc(inode) != (uint32_t)inode->inode_crc) return -EIO;
+
+    st->ino = ino;
+    st->mode = inode->mode;
+    st->links = inode->links;
+    st->uid = inode->uid;
+    st->gid = inode->gid;
+    st->size = inode->size_bytes;
+    st->atime = inode->atime;
+    st->mtime = inode->mtime;
+    st->ctime = inode->ctime;
+    st->flags = inode->iflags;
+    return 0;
+}
+
+ssize_t mvfs_read_extent(const mvfs_image_t* img, uint32_t ino, uint64_t off,
+                         size_t len, const void** data) {
+    const inode_t* inode = inode_at(img, ino);
+    if (!inode) return -ENOENT;
+    if (inode->iflags & INODE_FLAG_COMPRESSED) return -EOPNOTSUPP;
+    if (off >= inode->size_bytes || len == 0) return 0;
+    if (len > inode->size_bytes - off) len = inode->size_bytes - off;
+
+    uint64_t i = off / BS;
+    uint32_t first = file_block(img, inode, i);
+    if (!valid_block(img, first)) return -EIO;
+
+    // Extend over physically consecutive blocks
+    size_t avail = BS - off % BS;
+    uint32_t prev = first;
+    while (avail < len) {
+        uint32_t next = file_block(img, inode, ++i);
+        if (next != prev + 1 || !valid_block(img, next)) break;
+        avail += BS;
+        prev = next;
+    }
+
+    *data = (const uint8_t*)block_ptr(img->base, first) + off % BS;
+    return avail < len ? avail : len;
+}
+
+// Copy "len" bytes from byte "off" of the file's block list, block by block
+static int copy_blocks(const mvfs_image_t* img, const inode_t* inode, uint64_t off, size_t len,
+                       uint8_t* dst) {
+    while (len > 0) {
+        uint32_t block = file_block(img, inode, off / BS);
+        if (!valid_block(img, block)) return -EIO;
+        size_t n = BS - off % BS < len ? BS - off % BS : len;
+        memcpy(dst, (const uint8_t*)block_ptr(img->base, block) + off % BS, n);
+        dst += n;
+        off += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// "len" bytes at block "first" of the file's block list, if those blocks are
+// physically consecutive, else NULL
+static const uint8_t* contiguous_blocks(const mvfs_image_t* img, const inode_t* inode,
+                                        uint64_t first, size_t len) {
+    uint32_t start = file_block(img, inode, first);
+    if (!valid_block(img, start)) return NULL;
+    for (uint64_t i = 1; i < (len + BS - 1) / BS; i++) {
+        uint32_t b = file_block(img, inode, first + i);
+        if (b != start + i || !valid_block(img, b)) return NULL;
+    }
+    return block_ptr(img->base, start);
+}
+
+// Read from a compressed file. Each chunk the range covers is decoded
+// straight into buf when the range spans the whole chunk, otherwise into a
+// scratch buffer first. Compressed bytes are decoded in place from the
+// mapping unless the chunk's blocks are scattered.
+static ssize_t pread_compressed(const mvfs_image_t* img, const inode_t* inode, uint8_t* buf,
+                                size_t len, uint64_t off) {
+    if (off >= inode->size_bytes || len == 0) return 0;
+    if (len > inode->size_bytes - off) len = inode->size_bytes - off;
+
+    uint32_t map_block = file_block(img, inode, 0);
+    if (!valid_block(img, map_block)) return -EIO;
+    const chunk_map_t* map = (const chunk_map_t*)block_ptr(img->base, map_block);
+    if (map->chunk_count != (inode->size_bytes + CHUNK_BYTES - 1) / CHUNK_BYTES ||
+        map->stored_blocks > (inode->size_bytes + BS - 1) / BS) {
+        return -EIO;
+    }
+
+    uint8_t* scratch = NULL;    // decoded chunk, then gathered compressed bytes
+    size_t in_cap = lz4_bound(CHUNK_BYTES);
+    ssize_t err = 0;
+    size_t done = 0;
+    while (done < len && err == 0) {
+        uint64_t pos = off + done;
+        uint64_t c = pos / CHUNK_BYTES;
+        size_t chunk_len = inode->size_bytes - c * CHUNK_BYTES < CHUNK_BYTES
+                         ? inode->size_bytes - c * CHUNK_BYTES : CHUNK_BYTES;
+        size_t in = pos % CHUNK_BYTES;
+        size_t want = chunk_len - in < len - done ? chunk_len - in : len - done;
+
+        chunk_entry_t e;
+        err = copy_blocks(img, inode, sizeof(chunk_map_t) + c * sizeof(chunk_entry_t), sizeof(e),
+                          (uint8_t*)&e);
+        if (err) break;
+        size_t stored_len = e.clen ? e.clen : chunk_len;
+        if (e.clen > in_cap || e.block + (stored_len + BS - 1) / BS > map->stored_blocks) {
+            err = -EIO;
+            break;
+        }
+
+        if (e.clen == 0) {
+            err = copy_blocks(img, inode, (uint64_t)e.block * BS + in, want, buf + done);
+        } else {
+            if (!scratch && !(scratch = malloc(CHUNK_BYTES + in_cap))) {
+                err = -ENOMEM;
+                break;
+            }
+            const uint8_t* src = contiguous_blocks(img, inode, e.block, e.clen);
+            if (!src) {
+                err = copy_blocks(img, inode, (uint64_t)e.block * BS, e.clen, scratch + CHUNK_BYTES);
+                src = scratch + CHUNK_BYTES;
+            }
+            uint8_t* dst = in == 0 && want == chunk_len ? buf + done : scratch;
+            if (!err && lz4_decompress(src, e.clen, dst, chunk_len) != (long)chunk_len) err = -EIO;
+            if (!err && dst == scratch) memcpy(buf + done, scratch + in, want);
+        }
+        done += want;
+    }
+    free(scratch);
+    return err ? err : (ssize_t)done;
+}
+
+ssize_t mvfs_pread(const mvfs_image_t* img, uint32_t ino, void* buf, size_t len, uint64_t off) {
+    const inode_t* inode = inode_at(img, ino);
+    if (!inode) return -ENOENT;
+    if (inode->iflags & INODE_FLAG_COMPRESSED) return pread_compressed(img, inode, buf, len, off);
+
+    size_t done = 0;
+    while (done < len) {
+        const void* p;
+        ssize_t n = mvfs_read_extent(img, ino, off + done, len - done, &p);
+        if (n < 0) return n;
+        if (n == 0) break;
+        memcpy((uint8_t*)buf + done, p, n);
+        done += n;
+    }
+    return done;
+}
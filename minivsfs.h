@@ -0,0 +1,76 @@
+// libminivsfs: read-only access to MiniVSFS images built by mkfs_builder and
+// mkfs_adder.
+//
+// Build: gcc -O2 -std=c17 -Wall -Wextra -fPIC -shared minivsfs.c -o libminivsfs.so
+//
+// The image is mmap'd read-only and never copied. Lookups go through a name
+// index built once at open, and mvfs_read_extent() hands back pointers
+// straight into the mapping. Functions return 0 (or a byte count) on
+// success and a negative errno value on failure.
+#ifndef MINIVSFS_H
+#define MINIVSFS_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+#include "minivsfs_format.h"
+
+typedef struct mvfs_image mvfs_image_t;
+
+typedef struct {
+    uint32_t ino;
+    uint16_t mode;
+    uint16_t links;
+    uint32_t uid;
+    uint32_t gid;
+    uint64_t size;
+    uint64_t atime;
+    uint64_t mtime;
+    uint64_t ctime;
+    uint32_t flags;         // INODE_FLAG_*
+} mvfs_stat_t;
+
+// Map an image and index its root directory. Fails with -EINVAL for a bad
+// magic or layout, -EIO for a superblock CRC mismatch, -ENOTSUP for
+// superblock flags this library does not know and -EBUSY while the journal
+// holds a transaction (mkfs_adder replays it the next time it opens the
+// image).
+int mvfs_open(const char* path, mvfs_image_t** out);
+void mvfs_close(mvfs_image_t* img);
+
+const superblock_t* mvfs_superblock(const mvfs_image_t* img);
+
+// Inode number of "path": a name in the root directory (which may contain
+// '/', as mkfs_adder --file names files by their host path), else
+// "dir/.../name" through subdirectories made by mkfs_adder --tree. -ENOENT
+// if a component is missing, -ENOTDIR if a directory in the path is a file.
+int mvfs_lookup(const mvfs_image_t* img, const char* path, uint32_t* ino);
+
+typedef struct {
+    uint32_t ino;
+    uint8_t type;           // 1=file, 2=dir
+    char name[58];          // NUL-terminated
+} mvfs_dirent_t;
+
+// List directory "dir" in slot order, "." and ".." included. Start with
+// *pos = 0; each call fills *ent with the next entry and moves *pos past it.
+// Returns 1 for an entry and 0 at the end; -ENOENT or -ENOTDIR for a bad
+// "dir".
+int mvfs_readdir(const mvfs_image_t* img, uint32_t dir, uint64_t* pos, mvfs_dirent_t* ent);
+
+// Inode attributes; -EIO if the inode's CRC does not match
+int mvfs_stat(const mvfs_image_t* img, uint32_t ino, mvfs_stat_t* st);
+
+// Zero-copy read: points *data at file offset "off" inside the mapping and
+// returns how many bytes (at most "len") are contiguous there. Call again at
+// off + returned to continue; 0 means end of file. Compressed files have no
+// such bytes and fail with -EOPNOTSUPP.
+ssize_t mvfs_read_extent(const mvfs_image_t* img, uint32_t ino, uint64_t off,
+                         size_t len, const void** data);
+
+// Copying read built on mvfs_read_extent(). Compressed files are decoded
+// straight into buf, chunk by chunk.
+ssize_t mvfs_pread(const mvfs_image_t* img, uint32_t ino, void* buf, size_t len, uint64_t off);
+
+#endif // MINIVSFS_H
@@ -0,0 +1,235 @@
+// MiniVSFS on-disk format, shared by mkfs_builder, mkfs_adder, mkfs_check,
+// mkfs_defrag and libminivsfs: block and inode geometry, the packed
+// structures with their layout pinned by _Static_assert, the checksum
+// helpers and offset accessors. Header-only so each tool still builds from
+// one command; a layout change made here reaches every tool.
+#ifndef MINIVSFS_FORMAT_H
+#define MINIVSFS_FORMAT_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "crc32.h"
+
+#define BS 4096u                // block size
+#define BS_SHIFT 12
+#define INODE_SIZE 128u
+#define INODE_SHIFT 7
+#define ROOT_INO 1u
+#define DIRECT_MAX 12
+#define PTRS_PER_BLOCK (BS / sizeof(uint32_t))
+_Static_assert(BS == 1u << BS_SHIFT && INODE_SIZE == 1u << INODE_SHIFT, "geometry must be powers of two");
+
+#define MINIVSFS_MAGIC 0x4653564Du  // "MVSF" as stored, little-endian
+
+// superblock_t.flags
+#define SB_FLAG_INDIRECT 0x1u   // inodes may use indirect/double_indirect (set by mkfs_adder)
+#define SB_FLAG_JOURNAL  0x2u   // journal_start/journal_blocks hold a metadata journal
+#define SB_FLAG_DEDUP    0x4u   // data blocks may be shared between inodes (set by mkfs_adder --dedup)
+#define SB_FLAG_COMPRESS 0x8u   // some inodes have INODE_FLAG_COMPRESSED (set by mkfs_adder --compress)
+#define SB_KNOWN_FLAGS (SB_FLAG_INDIRECT | SB_FLAG_JOURNAL | SB_FLAG_DEDUP | SB_FLAG_COMPRESS)
+
+// inode_t.iflags
+#define INODE_FLAG_COMPRESSED 0x1u  // data is stored as LZ4 chunks behind a chunk map
+
+#pragma pack(push, 1)
+typedef struct {
+    uint32_t magic;                 // MINIVSFS_MAGIC
+    uint32_t version;               // 1
+    uint32_t block_size;            // 4096
+    uint64_t total_blocks;          // size_kib * 1024 / 4096
+    uint64_t inode_count;           // number of inodes
+    uint64_t inode_bitmap_start;    // block number where inode bitmap starts
+    uint64_t inode_bitmap_blocks;   // number of blocks for inode bitmap
+    uint64_t data_bitmap_start;     // block number where data bitmap starts
+    uint64_t data_bitmap_blocks;    // number of blocks for data bitmap
+    uint64_t inode_table_start;     // block number where inode table starts
+    uint64_t inode_table_blocks;    // number of blocks for inode table
+    uint64_t data_region_start;     // block number where data region starts
+    uint64_t data_region_blocks;    // number of blocks for data region
+    uint64_t root_inode;            // 1
+    uint64_t mtime_epoch;           // build time
+    uint32_t flags;                 // SB_FLAG_*
+    uint32_t checksum;              // crc32(superblock[0..4091])
+    uint64_t journal_start;         // first journal block (SB_FLAG_JOURNAL), else 0
+    uint64_t journal_blocks;        // journal header + log blocks, else 0
+} superblock_t;
+#pragma pack(pop)
+_Static_assert(sizeof(superblock_t) == 132, "superblock must fit in one block");
+_Static_assert(offsetof(superblock_t, flags) == 108 && offsetof(superblock_t, checksum) == 112,
+               "superblock field moved");
+
+#pragma pack(push,1)
+typedef struct {
+    uint16_t mode;          // file type: 0100000 (octal) for files, 0040000 (octal) for dirs
+    uint16_t links;         // number of directories pointing to this inode
+    uint32_t uid;           // user id (0)
+    uint32_t gid;           // group id (0)
+    uint64_t size_bytes;    // size in bytes
+    uint64_t atime;         // access time
+    uint64_t mtime;         // modify time
+    uint64_t ctime;         // create time
+    uint32_t direct[12];    // direct block pointers
+    uint32_t indirect;      // single-indirect block (SB_FLAG_INDIRECT), else 0
+    uint32_t double_indirect; // double-indirect block (SB_FLAG_INDIRECT), else 0
+    uint32_t iflags;        // INODE_FLAG_*, 0 for plain files
+    uint32_t proj_id;       // your group ID
+    uint32_t uid16_gid16;   // 0
+    uint64_t xattr_ptr;     // 0
+    uint64_t inode_crc;     // crc32 of bytes 0..119 in the low 4 bytes
+} inode_t;
+#pragma pack(pop)
+_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
+_Static_assert(offsetof(inode_t, direct) == 44 && offsetof(inode_t, inode_crc) == 120, "inode field moved");
+
+// Bytes of an inode covered by inode_crc
+#define INODE_CRC_BYTES offsetof(inode_t, inode_crc)
+
+// A compressed file's blocks start with a chunk map, followed by each
+// CHUNK_BYTES chunk of the file, LZ4-compressed or raw when that would not
+// save a block. size_bytes stays the uncompressed size.
+#define CHUNK_BYTES (16 * BS)
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t block;         // index of the chunk's first block among the file's blocks
+    uint32_t clen;          // compressed bytes, 0 if the chunk is stored raw
+} chunk_entry_t;
+
+typedef struct {
+    uint32_t stored_blocks; // blocks the file occupies, chunk map included
+    uint32_t chunk_count;   // ceil(size_bytes / CHUNK_BYTES)
+    chunk_entry_t chunk[];  // continues across as many blocks as needed
+} chunk_map_t;
+#pragma pack(pop)
+_Static_assert(sizeof(chunk_entry_t) == 8 && sizeof(chunk_map_t) == 8, "chunk map layout");
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t inode_no;      // inode number (0 if free)
+    uint8_t  type;          // 1=file, 2=dir
+    char     name[58];      // filename
+    uint8_t  checksum;      // XOR of bytes 0..62
+} dirent64_t;
+#pragma pack(pop)
+_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
+_Static_assert(offsetof(dirent64_t, checksum) == 63, "dirent field moved");
+
+// First block of the journal region. The log blocks after it hold one
+// transaction's block images, in target[] order.
+#define JOURNAL_MAGIC 0x4C4A564Du   // "MVJL"
+#define JOURNAL_MAX_TARGETS ((BS - 24) / sizeof(uint64_t))
+
+#pragma pack(push,1)
+typedef struct {
+    uint32_t magic;         // JOURNAL_MAGIC
+    uint32_t header_crc;    // crc32 of bytes 8 .. 24 + 8 * count
+    uint64_t sequence;      // bumped on every commit
+    uint32_t count;         // logged blocks; 0 = nothing to replay
+    uint32_t payload_crc;   // crc32 of the count logged blocks
+    uint64_t target[JOURNAL_MAX_TARGETS]; // home block of each logged block
+} journal_header_t;
+#pragma pack(pop)
+_Static_assert(sizeof(journal_header_t) == BS, "journal header must fill one block");
+
+// Offsets. Inode numbers start at 1 and sit in table order.
+static inline uint64_t block_offset(uint64_t block) {
+    return block << BS_SHIFT;
+}
+
+static inline uint64_t inode_offset(const superblock_t* sb, uint32_t ino) {
+    return block_offset(sb->inode_table_start) + ((uint64_t)(ino - 1) << INODE_SHIFT);
+}
+
+// Block of a bitmap starting at block "start" that holds bit "bit"
+#define BITS_PER_BITMAP_BLOCK ((uint64_t)BS * 8)
+static inline uint64_t bitmap_block_of(uint64_t start, uint64_t bit) {
+    return start + bit / BITS_PER_BITMAP_BLOCK;
+}
+
+// Block of the inode table holding inode "ino"
+static inline uint64_t inode_table_block(const superblock_t* sb, uint32_t ino) {
+    return sb->inode_table_start + ((ino - 1) >> (BS_SHIFT - INODE_SHIFT));
+}
+
+// Block "block" of an image held at "base"; like strchr, the result drops
+// const so one accessor serves read-only and writable mappings
+static inline void* block_ptr(const void* base, uint64_t block) {
+    return (uint8_t*)base + block_offset(block);
+}
+
+static inline inode_t* inode_ptr(const void* base, const superblock_t* sb, uint32_t ino) {
+    return (inode_t*)((uint8_t*)base + inode_offset(sb, ino));
+}
+
+// Region [start, start + blocks) lies in [*next, end); *next moves past it
+static inline int layout_region_ok(uint64_t start, uint64_t blocks, uint64_t* next, uint64_t end) {
+    if (start < *next || start > end || blocks > end - start) return 0;
+    *next = start + blocks;
+    return 1;
+}
+
+// Layout sanity for the superblock of an image of "image_blocks" blocks:
+// the regions lie inside the image in mkfs_builder's order (superblock,
+// inode bitmap, data bitmap, inode table, journal, data region) without
+// overlapping, and are large enough for inode_count and data_region_blocks.
+// A matching CRC does not vouch for these fields, so check this before
+// taking any pointer from the superblock.
+static inline int superblock_layout_ok(const superblock_t* sb, uint64_t image_blocks) {
+    if (sb->magic != MINIVSFS_MAGIC || sb->block_size != BS || sb->total_blocks > image_blocks) return 0;
+    uint64_t end = sb->total_blocks, next = 1;
+    if (!layout_region_ok(sb->inode_bitmap_start, sb->inode_bitmap_blocks, &next, end) ||
+        !layout_region_ok(sb->data_bitmap_start, sb->data_bitmap_blocks, &next, end) ||
+        !layout_region_ok(sb->inode_table_start, sb->inode_table_blocks, &next, end)) {
+        return 0;
+    }
+    if ((sb->flags & SB_FLAG_JOURNAL) &&
+        (sb->journal_blocks < 2 || !layout_region_ok(sb->journal_start, sb->journal_blocks, &next, end))) {
+        return 0;
+    }
+    if (!layout_region_ok(sb->data_region_start, sb->data_region_blocks, &next, end)) return 0;
+    return sb->inode_count >= ROOT_INO &&
+           (sb->inode_count - 1) / BITS_PER_BITMAP_BLOCK < sb->inode_bitmap_blocks &&
+           (sb->inode_count - 1) / (BS / INODE_SIZE) < sb->inode_table_blocks &&
+           (sb->data_region_blocks + BITS_PER_BITMAP_BLOCK - 1) / BITS_PER_BITMAP_BLOCK <= sb->data_bitmap_blocks;
+}
+
+// Checksums. superblock_crc() hashes bytes 0..4091 of the superblock block
+// with the checksum field taken as zero, so it also works on a read-only
+// mapping.
+static inline uint32_t superblock_crc(const void* sb_block) {
+    const uint8_t zero[4] = {0};
+    const uint8_t* p = (const uint8_t*)sb_block;
+    size_t at = offsetof(superblock_t, checksum);
+    uint32_t c = crc32_update(0xFFFFFFFFu, p, at);
+    c = crc32_update(c, zero, sizeof(zero));
+    c = crc32_update(c, p + at + 4, BS - 4 - at - 4);
+    return c ^ 0xFFFFFFFFu;
+}
+
+static inline uint32_t inode_crc(const inode_t* ino) {
+    return crc32(ino, INODE_CRC_BYTES);
+}
+
+static inline uint8_t dirent_checksum(const dirent64_t* de) {
+    const uint8_t* p = (const uint8_t*)de;
+    uint8_t x = 0;
+    for (size_t i = 0; i < offsetof(dirent64_t, checksum); i++) x ^= p[i];
+    return x;
+}
+
+// WARNING: CALL THESE ONLY AFTER ALL OTHER FIELDS HAVE BEEN FINALIZED. "sb"
+// must point at a whole block.
+static inline void superblock_crc_finalize(superblock_t* sb) {
+    sb->checksum = superblock_crc(sb);
+}
+
+static inline void inode_crc_finalize(inode_t* ino) {
+    ino->inode_crc = (uint64_t)inode_crc(ino);
+}
+
+static inline void dirent_checksum_finalize(dirent64_t* de) {
+    de->checksum = dirent_checksum(de);
+}
+
+#endif // MINIVSFS_FORMAT_H
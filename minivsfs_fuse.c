@@ -0,0 +1,465 @@
+// minivsfs_fuse: read-only FUSE mount of images built by mkfs_builder and
+// mkfs_adder.
+//
+// Build: gcc -O2 -std=c17 -Wall -Wextra minivsfs_fuse.c minivsfs.c -o minivsfs_fuse
+//            $(pkg-config --cflags --libs fuse3)
+// Usage: ./minivsfs_fuse <image> <mountpoint> [-f] [-s] [-o <options>]
+//        fusermount3 -u <mountpoint>
+//
+// Uses the libfuse low-level API, which names files by inode number as the
+// image does. At mount every directory reachable from the root is read
+// once through libminivsfs: each inode becomes a ready struct stat in the
+// inode cache, and each dirent a (parent, name) -> inode entry in the
+// dentry cache. Neither changes afterwards, so request threads read them
+// without locks, and the kernel is told to keep entries, attributes and
+// file pages for good. read() replies with iovecs pointing into the image
+// mapping; only compressed files are decoded into a buffer first.
+//
+// mkfs_adder --file names a file by its host path, '/' included. Such names
+// are listed with each '/' shown as U+2215 DIVISION SLASH.
+#define FUSE_USE_VERSION 31
+#define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <fuse_lowlevel.h>
+
+#include "minivsfs.h"
+
+#define CACHE_TIMEOUT 86400.0       // seconds; the image never changes under the mount
+#define SLASH_SHOWN "\xE2\x88\x95"  // U+2215, in place of '/' in a name
+#define NAME_SHOWN_MAX (57 * 3)     // every byte of a 57-byte name a '/'
+
+// Inode cache entry. A directory's children are dentries[first .. first +
+// count), in slot order.
+typedef struct {
+    struct stat st;
+    uint32_t flags;         // INODE_FLAG_*
+    uint32_t parent;        // directories: inode of ".."
+    uint32_t first;
+    uint32_t count;
+} node_t;
+
+// Dentry cache entry
+typedef struct {
+    uint32_t parent;
+    uint32_t ino;
+    uint32_t name;          // offset into names
+} dentry_t;
+
+// Both caches are open-addressing tables of index + 1, 0 marking a free
+// bucket, sized to at most half full
+typedef struct {
+    mvfs_image_t* img;
+    node_t* nodes;
+    size_t node_count, node_cap;
+    uint32_t* node_hash;
+    dentry_t* dentries;
+    size_t dentry_count, dentry_cap;
+    uint32_t* dentry_hash;
+    char* names;
+    size_t names_len, names_cap;
+    size_t hash_mask;
+} mount_t;
+
+static uint32_t ino_hash(uint32_t ino) {
+    return ino * 2654435761u;
+}
+
+// FNV-1a over the parent's inode number, then the name
+static uint32_t dentry_key(uint32_t parent, const char* name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 4; i++) h = (h ^ ((parent >> (8 * i)) & 0xFF)) * 16777619u;
+    for (const uint8_t* p = (const uint8_t*)name; *p; p++) h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+static node_t* node_get(const mount_t* m, uint32_t ino) {
+    for (size_t b = ino_hash(ino) & m->hash_mask; m->node_hash[b] != 0; b = (b + 1) & m->hash_mask) {
+        node_t* n = &m->nodes[m->node_hash[b] - 1];
+        if (n->st.st_ino == ino) return n;
+    }
+    return NULL;
+}
+
+static const dentry_t* dentry_get(const mount_t* m, uint32_t parent, const char* name) {
+    size_t b = dentry_key(parent, name) & m->hash_mask;
+    for (; m->dentry_hash[b] != 0; b = (b + 1) & m->hash_mask) {
+        const dentry_t* d = &m->dentries[m->dentry_hash[b] - 1];
+        if (d->parent == parent && strcmp(m->names + d->name, name) == 0) return d;
+    }
+    return NULL;
+}
+
+static int grow(void** arr, size_t* cap, size_t need, size_t elem) {
+    if (need <= *cap) return 0;
+    size_t cap2 = *cap ? *cap : 256;
+    while (cap2 < need) cap2 *= 2;
+    void* p = realloc(*arr, cap2 * elem);
+    if (!p) return -ENOMEM;
+    *arr = p;
+    *cap = cap2;
+    return 0;
+}
+
+static void node_insert(mount_t* m, size_t i) {
+    size_t b = ino_hash(m->nodes[i].st.st_ino) & m->hash_mask;
+    while (m->node_hash[b] != 0) b = (b + 1) & m->hash_mask;
+    m->node_hash[b] = i + 1;
+}
+
+static void dentry_insert(mount_t* m, size_t i) {
+    const dentry_t* d = &m->dentries[i];
+    size_t b = dentry_key(d->parent, m->names + d->name) & m->hash_mask;
+    while (m->dentry_hash[b] != 0) b = (b + 1) & m->hash_mask;
+    m->dentry_hash[b] = i + 1;
+}
+
+// Make room for one more node and dentry, rebuilding both tables when they
+// would pass half full
+static int hash_reserve(mount_t* m) {
+    size_t need = ((m->node_count > m->dentry_count ? m->node_count : m->dentry_count) + 1) * 2;
+    if (m->node_hash && need <= m->hash_mask + 1) return 0;
+    size_t cap = 1024;
+    while (cap < need * 2) cap *= 2;
+    uint32_t* nh = calloc(cap, sizeof(uint32_t));
+    uint32_t* dh = calloc(cap, sizeof(uint32_t));
+    if (!nh || !dh) {
+        free(nh);
+        free(dh);
+        return -ENOMEM;
+    }
+    free(m->node_hash);
+    free(m->dentry_hash);
+    m->node_hash = nh;
+    m->dentry_hash = dh;
+    m->hash_mask = cap - 1;
+    for (size_t i = 0; i < m->node_count; i++) node_insert(m, i);
+    for (size_t i = 0; i < m->dentry_count; i++) dentry_insert(m, i);
+    return 0;
+}
+
+// Decode inode "ino" into the inode cache
+static int add_node(mount_t* m, uint32_t ino, uint32_t parent) {
+    mvfs_stat_t st;
+    int err = mvfs_stat(m->img, ino, &st);
+    if (err) return err;
+    if ((err = hash_reserve(m)) != 0 ||
+        (err = grow((void**)&m->nodes, &m->node_cap, m->node_count + 1, sizeof(node_t))) != 0) {
+        return err;
+    }
+
+    node_t* n = &m->nodes[m->node_count++];
+    memset(n, 0, sizeof(*n));
+    int is_dir = (st.mode & S_IFMT) == S_IFDIR;
+    n->st.st_ino = ino;
+    n->st.st_mode = (is_dir ? S_IFDIR | 0555 : S_IFREG | 0444);
+    n->st.st_nlink = st.links;
+    n->st.st_uid = st.uid;
+    n->st.st_gid = st.gid;
+    n->st.st_size = st.size;
+    n->st.st_blksize = BS;
+    n->st.st_blocks = (st.size + 511) / 512;
+    n->st.st_atim.tv_sec = st.atime;
+    n->st.st_mtim.tv_sec = st.mtime;
+    n->st.st_ctim.tv_sec = st.ctime;
+    n->flags = st.flags;
+    n->parent = parent;
+    node_insert(m, m->node_count - 1);
+    return 0;
+}
+
+// Add "name" in "parent" to the dentry cache, '/' shown as SLASH_SHOWN.
+// Returns 1 if the shown name is already taken.
+static int add_dentry(mount_t* m, uint32_t parent, const char* name, uint32_t ino) {
+    char shown[NAME_SHOWN_MAX + 1];
+    size_t len = 0;
+    for (const char* p = name; *p; p++) {
+        if (*p == '/') {
+            memcpy(shown + len, SLASH_SHOWN, 3);
+            len += 3;
+        } else {
+            shown[len++] = *p;
+        }
+    }
+    shown[len] = '\0';
+    if (dentry_get(m, parent, shown)) return 1;
+
+    int err = hash_reserve(m);
+    if (!err) err = grow((void**)&m->names, &m->names_cap, m->names_len + len + 1, 1);
+    if (!err) err = grow((void**)&m->dentries, &m->dentry_cap, m->dentry_count + 1, sizeof(dentry_t));
+    if (err) return err;
+    memcpy(m->names + m->names_len, shown, len + 1);
+    m->dentries[m->dentry_count++] = (dentry_t){ .parent = parent, .ino = ino, .name = m->names_len };
+    m->names_len += len + 1;
+    dentry_insert(m, m->dentry_count - 1);
+    return 0;
+}
+
+// Read every directory reachable from the root, breadth first. Entries with
+// a bad inode, a second link to a directory or a clashing shown name are
+// left out with a warning rather than failing the mount.
+static int build_caches(mount_t* m) {
+    int err = add_node(m, ROOT_INO, ROOT_INO);
+    if (err) return err;
+
+    for (size_t i = 0; i < m->node_count; i++) {
+        if (!S_ISDIR(m->nodes[i].st.st_mode)) continue;
+        uint32_t dir = m->nodes[i].st.st_ino;
+        uint32_t first = m->dentry_count;
+
+        uint64_t pos = 0;
+        mvfs_dirent_t ent;
+        while ((err = mvfs_readdir(m->img, dir, &pos, &ent)) == 1) {
+            if (strcmp(ent.name, ".") == 0 || strcmp(ent.name, "..") == 0) continue;
+            const node_t* seen = node_get(m, ent.ino);
+            if (seen && S_ISDIR(seen->st.st_mode)) {
+                fprintf(stderr, "Warning: skipping '%s': directory %u is linked twice\n", ent.name, ent.ino);
+                continue;
+            }
+            if (!seen && (err = add_node(m, ent.ino, dir)) != 0) {
+                if (err == -ENOMEM) return err;
+                fprintf(stderr, "Warning: skipping '%s': inode %u: %s\n", ent.name, ent.ino, strerror(-err));
+                continue;
+            }
+            if ((err = add_dentry(m, dir, ent.name, ent.ino)) < 0) return err;
+            if (err == 1) fprintf(stderr, "Warning: skipping '%s': name shown twice\n", ent.name);
+        }
+        if (err < 0) return err;
+
+        // add_node() may have moved the array
+        m->nodes[i].first = first;
+        m->nodes[i].count = m->dentry_count - first;
+    }
+    return 0;
+}
+
+static void mount_free(mount_t* m) {
+    free(m->nodes);
+    free(m->node_hash);
+    free(m->dentries);
+    free(m->dentry_hash);
+    free(m->names);
+    mvfs_close(m->img);
+}
+
+static void op_lookup(fuse_req_t req, fuse_ino_t parent, const char* name) {
+    const mount_t* m = fuse_req_userdata(req);
+    struct fuse_entry_param e;
+    memset(&e, 0, sizeof(e));
+    e.attr_timeout = CACHE_TIMEOUT;
+    e.entry_timeout = CACHE_TIMEOUT;
+
+    // A reply with ino 0 lets the kernel cache the miss as well
+    const dentry_t* d = dentry_get(m, parent, name);
+    if (d) {
+        e.ino = d->ino;
+        e.attr = node_get(m, d->ino)->st;
+    }
+    fuse_reply_entry(req, &e);
+}
+
+static void op_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    (void)fi;
+    const node_t* n = node_get(fuse_req_userdata(req), ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    fuse_reply_attr(req, &n->st, CACHE_TIMEOUT);
+}
+
+static void op_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info* fi) {
+    const node_t* n = node_get(fuse_req_userdata(req), ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+    } else if (S_ISDIR(n->st.st_mode)) {
+        fuse_reply_err(req, EISDIR);
+    } else if ((fi->flags & O_ACCMODE) != O_RDONLY) {
+        fuse_reply_err(req, EROFS);
+    } else {
+        fi->keep_cache = 1;
+        fuse_reply_open(req, fi);
+    }
+}
+
+// Plain files are answered with one fuse_buf per run of consecutive blocks,
+// straight from the mapping; compressed files are decoded into a buffer
+static void op_read(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                    struct fuse_file_info* fi) {
+    (void)fi;
+    const mount_t* m = fuse_req_userdata(req);
+    const node_t* n = node_get(m, ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+
+    if (n->flags & INODE_FLAG_COMPRESSED) {
+        void* buf = malloc(size ? size : 1);
+        ssize_t r = buf ? mvfs_pread(m->img, ino, buf, size, off) : -ENOMEM;
+        if (r < 0) {
+            fuse_reply_err(req, (int)-r);
+        } else {
+            fuse_reply_buf(req, buf, r);
+        }
+        free(buf);
+        return;
+    }
+
+    // A range of "size" bytes touches at most size / BS + 2 blocks
+    size_t max = size / BS + 2;
+    struct fuse_bufvec* bv = malloc(sizeof(*bv) + max * sizeof(struct fuse_buf));
+    if (!bv) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t done = 0, count = 0;
+    while (done < size && count < max) {
+        const void* p;
+        ssize_t r = mvfs_read_extent(m->img, ino, off + done, size - done, &p);
+        if (r < 0) {
+            fuse_reply_err(req, (int)-r);
+            free(bv);
+            return;
+        }
+        if (r == 0) break;
+        bv->buf[count++] = (struct fuse_buf){ .size = r, .mem = (void*)p, .fd = -1 };
+        done += r;
+    }
+    bv->count = count;
+    bv->idx = 0;
+    bv->off = 0;
+    if (count == 0) {
+        fuse_reply_buf(req, NULL, 0);
+    } else {
+        fuse_reply_data(req, bv, 0);
+    }
+    free(bv);
+}
+
+// Offsets: 0 is ".", 1 is "..", 2 + k the directory's k-th cached child
+static void op_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, off_t off,
+                       struct fuse_file_info* fi) {
+    (void)fi;
+    const mount_t* m = fuse_req_userdata(req);
+    const node_t* n = node_get(m, ino);
+    if (!n) {
+        fuse_reply_err(req, ENOENT);
+        return;
+    }
+    if (!S_ISDIR(n->st.st_mode)) {
+        fuse_reply_err(req, ENOTDIR);
+        return;
+    }
+
+    char* buf = malloc(size ? size : 1);
+    if (!buf) {
+        fuse_reply_err(req, ENOMEM);
+        return;
+    }
+    size_t used = 0;
+    for (uint64_t k = off; k < 2 + (uint64_t)n->count; k++) {
+        struct stat st;
+        memset(&st, 0, sizeof(st));
+        const char* name;
+        if (k < 2) {
+            name = k == 0 ? "." : "..";
+            st.st_ino = k == 0 ? ino : n->parent;
+            st.st_mode = S_IFDIR;
+        } else {
+            const dentry_t* d = &m->dentries[n->first + k - 2];
+            name = m->names + d->name;
+            st.st_ino = d->ino;
+            st.st_mode = node_get(m, d->ino)->st.st_mode & S_IFMT;
+        }
+        size_t len = fuse_add_direntry(req, buf + used, size - used, name, &st, k + 1);
+        if (len > size - used) break;
+        used += len;
+    }
+    fuse_reply_buf(req, buf, used);
+    free(buf);
+}
+
+static void op_statfs(fuse_req_t req, fuse_ino_t ino) {
+    (void)ino;
+    const mount_t* m = fuse_req_userdata(req);
+    const superblock_t* sb = mvfs_superblock(m->img);
+    struct statvfs s;
+    memset(&s, 0, sizeof(s));
+    s.f_bsize = BS;
+    s.f_frsize = BS;
+    s.f_blocks = sb->total_blocks;
+    s.f_files = sb->inode_count;
+    s.f_namemax = NAME_SHOWN_MAX;
+    s.f_flag = ST_RDONLY;
+    fuse_reply_statfs(req, &s);
+}
+
+static const struct fuse_lowlevel_ops ops = {
+    .lookup = op_lookup,
+    .getattr = op_getattr,
+    .open = op_open,
+    .read = op_read,
+    .readdir = op_readdir,
+    .statfs = op_statfs,
+};
+
+int main(int argc, char** argv) {
+    if (argc < 3 || argv[1][0] == '-') {
+        fprintf(stderr, "Usage: %s <image> <mountpoint> [-f] [-s] [-o <options>]\n", argv[0]);
+        return 1;
+    }
+
+    mount_t m;
+    memset(&m, 0, sizeof(m));
+    int err = mvfs_open(argv[1], &m.img);
+    if (err) {
+        fprintf(stderr, "Error: cannot open image '%s': %s\n", argv[1], strerror(-err));
+        return 1;
+    }
+    if ((err = build_caches(&m)) != 0) {
+        fprintf(stderr, "Error: reading directories: %s\n", strerror(-err));
+        mount_free(&m);
+        return 1;
+    }
+
+    // Hand libfuse the arguments without the image path
+    argv[1] = argv[0];
+    struct fuse_args args = FUSE_ARGS_INIT(argc - 1, argv + 1);
+    struct fuse_cmdline_opts opts;
+    memset(&opts, 0, sizeof(opts));
+    struct fuse_session* se = NULL;
+    int ret = 1;
+    if (fuse_parse_cmdline(&args, &opts) != 0) goto out;
+    if (!opts.mountpoint) {
+        fprintf(stderr, "Error: no mountpoint given\n");
+        goto out;
+    }
+    if (fuse_opt_add_arg(&args, "-oro") != 0) goto out;
+
+    se = fuse_session_new(&args, &ops, sizeof(ops), &m);
+    if (!se) goto out;
+    if (fuse_set_signal_handlers(se) != 0) goto out;
+    if (fuse_session_mount(se, opts.mountpoint) == 0) {
+        fuse_daemonize(opts.foreground);
+        ret = opts.singlethread ? fuse_session_loop(se) : fuse_session_loop_mt(se, opts.clone_fd);
+        fuse_session_unmount(se);
+    }
+    fuse_remove_signal_handlers(se);
+
+out:
+    if (se) fuse_session_destroy(se);
+    free(opts.mountpoint);
+    fuse_opt_free_args(&args);
+    mount_free(&m);
+    return ret ? 1 : 0;
+}
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #define _FILE_OFFSET_BITS 64
 #include <stdio.h>
 #include <stdint.h>
@@ -7,388 +8,2890 @@
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <dirent.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define BS 4096u
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
-#define DIRECT_MAX 12
-#pragma pack(push, 1)
+#include "lz4_block.h"
+#include "minivsfs_format.h"
+#include "mkfs_args.h"
 
+// Bytes fed through crc32() since start-up, reported by --stats
+static uint64_t crc_bytes_hashed = 0;
+
+// inode_crc_finalize(), counted for --stats
+static void inode_crc_finalize_counted(inode_t* ino) {
+    inode_crc_finalize(ino);
+    crc_bytes_hashed += INODE_CRC_BYTES;
+}
+
+// Bitmap allocator. Bit i lives in byte i/8, bit i%8, so on a little-endian
+// load bit i is bit i%64 of 64-bit word i/64 and whole words can be scanned
+// with __builtin_ctzll. "hint" is a cursor with no free bit below it, so
+// consecutive allocations never rescan the used prefix.
+typedef struct {
+    uint8_t* bits;
+    size_t nbits;
+    size_t hint;
+} bitmap_t;
+
+static uint64_t bitmap_word(const bitmap_t* bm, size_t w) {
+    uint64_t word = 0;
+    size_t bytes = (bm->nbits + 7) / 8 - w * 8;
+    memcpy(&word, bm->bits + w * 8, bytes < 8 ? bytes : 8);
+    return word;
+}
+
+// Index of the first bit at or after "from" that is clear (want_set == 0)
+// or set (want_set == 1); nbits if there is none
+static size_t bitmap_scan(const bitmap_t* bm, size_t from, int want_set) {
+    size_t words = (bm->nbits + 63) / 64;
+    for (size_t w = from / 64; w < words; w++) {
+        uint64_t word = bitmap_word(bm, w);
+        if (!want_set) word = ~word;
+        if (w == from / 64) word &= ~0ull << (from % 64);
+        if (word) {
+            size_t bit = w * 64 + __builtin_ctzll(word);
+            return bit < bm->nbits ? bit : bm->nbits;
+        }
+    }
+    return bm->nbits;
+}
+
+static int bitmap_test(const bitmap_t* bm, size_t bit) {
+    return (bm->bits[bit / 8] >> (bit % 8)) & 1;
+}
+
+static void bitmap_set(bitmap_t* bm, size_t bit) {
+    bm->bits[bit / 8] |= (uint8_t)(1u << (bit % 8));
+    if (bit == bm->hint) bm->hint = bitmap_scan(bm, bit + 1, 0);
+}
+
+// Release a bit (used to roll back allocations)
+static void bitmap_clear(bitmap_t* bm, size_t bit) {
+    bm->bits[bit / 8] &= (uint8_t)~(1u << (bit % 8));
+    if (bit < bm->hint) bm->hint = bit;
+}
+
+static void bitmap_init(bitmap_t* bm, uint8_t* bits, size_t nbits) {
+    bm->bits = bits;
+    bm->nbits = nbits;
+    bm->hint = 0;
+    bm->hint = bitmap_scan(bm, 0, 0);
+}
+
+// First free bit, or -1 when the bitmap is full
+static long bitmap_find_free(const bitmap_t* bm) {
+    return bm->hint < bm->nbits ? (long)bm->hint : -1;
+}
+
+// Free-extent map over the data bitmap, rebuilt from it on load. Each run of
+// free blocks is one node, kept in two treaps: ordered by start, with the
+// longest run of every subtree for first fit, and by (length, start) for best
+// fit. Allocations find their run without rescanning the bitmap, and released
+// blocks merge back into the runs around them. Both orders pick exactly the
+// run a bitmap scan from the lowest free bit would.
+enum { BY_START, BY_LEN };
+
+typedef struct free_run {
+    size_t start;
+    size_t len;
+    size_t max_len;                 // longest run in this node's by-start subtree
+    uint32_t prio;
+    struct free_run* kid[2][2];     // [BY_START or BY_LEN][left, right]
+} free_run_t;
+
+typedef struct {
+    bitmap_t* bm;                   // the bitmap it mirrors
+    free_run_t* root[2];
+    uint32_t seed;                  // xorshift state for node priorities
+    int stale;                      // a release was not recorded; rebuild before use
+} free_map_t;
+
+static int run_before(int t, const free_run_t* a, const free_run_t* b) {
+    if (t == BY_LEN && a->len != b->len) return a->len < b->len;
+    return a->start < b->start;
+}
+
+static void run_update(int t, free_run_t* n) {
+    if (t != BY_START) return;
+    n->max_len = n->len;
+    for (int s = 0; s < 2; s++) {
+        if (n->kid[t][s] && n->kid[t][s]->max_len > n->max_len) n->max_len = n->kid[t][s]->max_len;
+    }
+}
+
+// Split tree "n" into the runs ordered before "key" and the rest
+static void run_split(int t, free_run_t* n, const free_run_t* key, free_run_t** l, free_run_t** r) {
+    if (!n) {
+        *l = *r = NULL;
+    } else if (run_before(t, n, key)) {
+        run_split(t, n->kid[t][1], key, &n->kid[t][1], r);
+        *l = n;
+    } else {
+        run_split(t, n->kid[t][0], key, l, &n->kid[t][0]);
+        *r = n;
+    }
+    if (n) run_update(t, n);
+}
+
+static free_run_t* run_merge(int t, free_run_t* l, free_run_t* r) {
+    if (!l || !r) return l ? l : r;
+    if (l->prio > r->prio) {
+        l->kid[t][1] = run_merge(t, l->kid[t][1], r);
+        run_update(t, l);
+        return l;
+    }
+    r->kid[t][0] = run_merge(t, l, r->kid[t][0]);
+    run_update(t, r);
+    return r;
+}
+
+static void run_insert(int t, free_run_t** p, free_run_t* n) {
+    if (!*p || n->prio > (*p)->prio) {
+        run_split(t, *p, n, &n->kid[t][0], &n->kid[t][1]);
+        run_update(t, n);
+        *p = n;
+        return;
+    }
+    run_insert(t, &(*p)->kid[t][!run_before(t, n, *p)], n);
+    run_update(t, *p);
+}
+
+static void run_erase(int t, free_run_t** p, const free_run_t* n) {
+    if (*p == n) {
+        *p = run_merge(t, n->kid[t][0], n->kid[t][1]);
+        return;
+    }
+    run_erase(t, &(*p)->kid[t][!run_before(t, n, *p)], n);
+    run_update(t, *p);
+}
+
+static void free_map_link(free_map_t* fm, free_run_t* n) {
+    run_insert(BY_START, &fm->root[BY_START], n);
+    run_insert(BY_LEN, &fm->root[BY_LEN], n);
+}
+
+static void free_map_unlink(free_map_t* fm, free_run_t* n) {
+    run_erase(BY_START, &fm->root[BY_START], n);
+    run_erase(BY_LEN, &fm->root[BY_LEN], n);
+}
+
+static free_run_t* free_run_new(free_map_t* fm, size_t start, size_t len) {
+    free_run_t* n = calloc(1, sizeof(free_run_t));
+    if (!n) return NULL;
+    fm->seed ^= fm->seed << 13;
+    fm->seed ^= fm->seed >> 17;
+    fm->seed ^= fm->seed << 5;
+    n->start = start;
+    n->len = len;
+    n->prio = fm->seed;
+    return n;
+}
+
+static void free_runs_destroy(free_run_t* n) {
+    if (!n) return;
+    free_runs_destroy(n->kid[BY_START][0]);
+    free_runs_destroy(n->kid[BY_START][1]);
+    free(n);
+}
+
+static void free_map_destroy(free_map_t* fm) {
+    free_runs_destroy(fm->root[BY_START]);
+    fm->root[BY_START] = fm->root[BY_LEN] = NULL;
+}
+
+// (Re)build the map from the clear bits of "bm"
+static int free_map_build(free_map_t* fm, bitmap_t* bm) {
+    free_map_destroy(fm);
+    fm->bm = bm;
+    fm->seed = 2463534242u;
+    fm->stale = 1;
+    size_t start = bitmap_scan(bm, 0, 0);
+    while (start < bm->nbits) {
+        size_t end = bitmap_scan(bm, start, 1);
+        free_run_t* n = free_run_new(fm, start, end - start);
+        if (!n) {
+            perror("calloc");
+            return -1;
+        }
+        free_map_link(fm, n);
+        start = end < bm->nbits ? bitmap_scan(bm, end, 0) : end;
+    }
+    fm->stale = 0;
+    return 0;
+}
+
+// Record the (already clear) bits start .. start + len - 1 as free. If that
+// needs memory that is not there, the map is rebuilt on its next use.
+static void free_map_insert(free_map_t* fm, size_t start, size_t len) {
+    if (fm->stale) return;
+    free_run_t* pred = NULL;
+    free_run_t* succ = NULL;
+    for (free_run_t* n = fm->root[BY_START]; n; ) {
+        if (n->start < start) {
+            pred = n;
+            n = n->kid[BY_START][1];
+        } else {
+            succ = n;
+            n = n->kid[BY_START][0];
+        }
+    }
+    if (pred && pred->start + pred->len != start) pred = NULL;
+    if (succ && start + len != succ->start) succ = NULL;
+    
+    if (pred) {
+        free_map_unlink(fm, pred);
+        pred->len += len;
+        if (succ) {
+            free_map_unlink(fm, succ);
+            pred->len += succ->len;
+            free(succ);
+        }
+        free_map_link(fm, pred);
+    } else if (succ) {
+        free_map_unlink(fm, succ);
+        succ->start = start;
+        succ->len += len;
+        free_map_link(fm, succ);
+    } else {
+        free_run_t* n = free_run_new(fm, start, len);
+        if (!n) {
+            fm->stale = 1;
+            return;
+        }
+        free_map_link(fm, n);
+    }
+}
+
+// Give back one bit (used to roll back allocations and to free blocks)
+static void free_map_release(free_map_t* fm, size_t bit) {
+    bitmap_clear(fm->bm, bit);
+    free_map_insert(fm, bit, 1);
+}
+
+// Allocate "count" adjacent bits and return the first: from the lowest run
+// long enough (first fit; with count 1, the first free bit), or with "best"
+// from the shortest such run, lowest on ties. -1 when no run fits.
+static long free_map_alloc(free_map_t* fm, size_t count, int best) {
+    if (fm->stale && free_map_build(fm, fm->bm) != 0) return -1;
+    free_run_t* n = fm->root[best ? BY_LEN : BY_START];
+    free_run_t* found = NULL;
+    while (n) {
+        if (best) {
+            // Lower bound of (count, 0)
+            if (n->len >= count) {
+                found = n;
+                n = n->kid[BY_LEN][0];
+            } else {
+                n = n->kid[BY_LEN][1];
+            }
+        } else if (n->kid[BY_START][0] && n->kid[BY_START][0]->max_len >= count) {
+            n = n->kid[BY_START][0];
+        } else if (n->len >= count) {
+            found = n;
+            break;
+        } else {
+            n = n->max_len >= count ? n->kid[BY_START][1] : NULL;
+        }
+    }
+    if (!found) return -1;
+    
+    size_t start = found->start;
+    free_map_unlink(fm, found);
+    if (found->len == count) {
+        free(found);
+    } else {
+        found->start += count;
+        found->len -= count;
+        free_map_link(fm, found);
+    }
+    for (size_t i = 0; i < count; i++) bitmap_set(fm->bm, start + i);
+    return (long)start;
+}
+
+// In-memory view of a filesystem image. Either a private heap copy that is
+// written out in full to --output, or (with --in-place) a mapping of the
+// image itself where only the touched blocks are flushed. Images with a
+// journal are mapped MAP_PRIVATE so no change reaches the file before it is
+// journaled; the others are mapped MAP_SHARED and msync'd.
+typedef struct {
+    uint8_t* base;
+    size_t size;
+    int fd;                 // -1 for heap images
+    int journaled;          // MAP_PRIVATE, written back by journal_commit()
+    uint64_t* dirty;        // block numbers modified in place
+    size_t dirty_count;
+    size_t dirty_cap;
+    pthread_mutex_t dirty_lock; // batch workers fill blocks concurrently
+} image_t;
+
+static void image_release(image_t* img) {
+    if (img->fd >= 0) {
+        munmap(img->base, img->size);
+        close(img->fd);
+    } else {
+        free(img->base);
+    }
+    free(img->dirty);
+    img->base = NULL;
+    img->dirty = NULL;
+}
+
+// Read the whole image into a heap buffer
+static int image_load(image_t* img, const char* path) {
+    FILE* input_fp = fopen(path, "rb");
+    if (!input_fp) {
+        perror("fopen input");
+        return -1;
+    }
+    
+    // Get file size
+    fseek(input_fp, 0, SEEK_END);
+    img->size = ftell(input_fp);
+    fseek(input_fp, 0, SEEK_SET);
+    
+    img->base = malloc(img->size);
+    if (!img->base) {
+        perror("malloc");
+        fclose(input_fp);
+        return -1;
+    }
+    
+    if (fread(img->base, 1, img->size, input_fp) != img->size) {
+        fprintf(stderr, "Error reading input file\n");
+        free(img->base);
+        img->base = NULL;
+        fclose(input_fp);
+        return -1;
+    }
+    fclose(input_fp);
+    return 0;
+}
+
+// Map the image read/write so stores go straight to the page cache
+static int image_map(image_t* img, const char* path) {
+    int fd = open(path, O_RDWR);
+    if (fd < 0) {
+        perror("open image");
+        return -1;
+    }
+    
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        perror("fstat image");
+        close(fd);
+        return -1;
+    }
+    superblock_t sb;
+    if (st.st_size < (off_t)BS || pread(fd, &sb, sizeof(sb), 0) != (ssize_t)sizeof(sb)) {
+        fprintf(stderr, "Error: image too small\n");
+        close(fd);
+        return -1;
+    }
+    int journaled = (sb.flags & SB_FLAG_JOURNAL) != 0;
+    
+    void* base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+                      journaled ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap image");
+        close(fd);
+        return -1;
+    }
+    
+    img->base = base;
+    img->size = st.st_size;
+    img->fd = fd;
+    img->journaled = journaled;
+    return 0;
+}
+
+// Remember that a block was modified so it gets flushed on commit. The
+// list is sorted before use, so the order workers add blocks in is moot.
+static int mark_dirty(image_t* img, uint64_t block) {
+    if (img->fd < 0) return 0;
+    pthread_mutex_lock(&img->dirty_lock);
+    if (img->dirty_count == img->dirty_cap) {
+        size_t cap = img->dirty_cap ? img->dirty_cap * 2 : 32;
+        uint64_t* d = realloc(img->dirty, cap * sizeof(uint64_t));
+        if (!d) {
+            perror("realloc");
+            pthread_mutex_unlock(&img->dirty_lock);
+            return -1;
+        }
+        img->dirty = d;
+        img->dirty_cap = cap;
+    }
+    img->dirty[img->dirty_count++] = block;
+    pthread_mutex_unlock(&img->dirty_lock);
+    return 0;
+}
+
+static int cmp_u64(const void* a, const void* b) {
+    uint64_t x = *(const uint64_t*)a, y = *(const uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+// Sort the dirty list and drop duplicates
+static void image_sort_dirty(image_t* img) {
+    if (img->dirty_count == 0) return;
+    qsort(img->dirty, img->dirty_count, sizeof(uint64_t), cmp_u64);
+    size_t n = 1;
+    for (size_t i = 1; i < img->dirty_count; i++) {
+        if (img->dirty[i] != img->dirty[n - 1]) img->dirty[n++] = img->dirty[i];
+    }
+    img->dirty_count = n;
+}
+
+// msync only the dirty blocks, coalesced into runs of adjacent blocks
+static int image_sync_dirty(image_t* img) {
+    if (img->dirty_count == 0) return 0;
+    
+    image_sort_dirty(img);
+    
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t i = 0;
+    while (i < img->dirty_count) {
+        uint64_t first = img->dirty[i];
+        uint64_t last = first;
+        while (++i < img->dirty_count && img->dirty[i] <= last + 1) {
+            last = img->dirty[i];
+        }
+        
+        size_t start = block_offset(first);
+        size_t end = block_offset(last + 1);
+        size_t aligned = start & ~(page - 1);
+        if (msync(img->base + aligned, end - aligned, MS_SYNC) != 0) {
+            perror("msync");
+            return -1;
+        }
+    }
+    img->dirty_count = 0;
+    return 0;
+}
+
+// Write "count" blocks from buf to the image file at block "block"
+static int write_blocks(int fd, const uint8_t* buf, uint64_t block, size_t count) {
+    size_t len = count * BS, done = 0;
+    while (done < len) {
+        ssize_t n = pwrite(fd, buf + done, len - done, (off_t)(block_offset(block) + done));
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) {
+            perror("pwrite image");
+            return -1;
+        }
+        done += n;
+    }
+    return 0;
+}
+
+static int sync_image(int fd) {
+    if (fdatasync(fd) != 0) {
+        perror("fdatasync image");
+        return -1;
+    }
+    return 0;
+}
+
+static journal_header_t* journal_header(image_t* img) {
+    const superblock_t* sb = (const superblock_t*)img->base;
+    return (journal_header_t*)block_ptr(img->base, sb->journal_start);
+}
+
+static size_t journal_capacity(const superblock_t* sb) {
+    size_t cap = sb->journal_blocks - 1;
+    return cap < JOURNAL_MAX_TARGETS ? cap : JOURNAL_MAX_TARGETS;
+}
+
+static uint32_t journal_header_crc(const journal_header_t* jh) {
+    return crc32((const uint8_t*)jh + 8, 16 + (size_t)jh->count * sizeof(uint64_t));
+}
+
+// A header describes a committed transaction only if both CRCs match and
+// every target lies in the image but outside the journal
+static int journal_committed(const superblock_t* sb, const journal_header_t* jh, const uint8_t* log) {
+    if (jh->magic != JOURNAL_MAGIC || jh->count == 0 || jh->count > journal_capacity(sb) ||
+        jh->header_crc != journal_header_crc(jh) ||
+        jh->payload_crc != crc32(log, (size_t)jh->count * BS)) {
+        return 0;
+    }
+    for (uint32_t i = 0; i < jh->count; i++) {
+        uint64_t t = jh->target[i];
+        if (t >= sb->total_blocks || (t >= sb->journal_start && t < sb->journal_start + sb->journal_blocks)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Finish an in-place update that was interrupted after its commit: copy each
+// logged block home (to the file too when mapped), then clear the journal.
+// A header that fails its checks was never committed and is just cleared.
+static int journal_replay(image_t* img) {
+    const superblock_t* sb = (const superblock_t*)img->base;
+    journal_header_t* jh = journal_header(img);
+    if (jh->magic != JOURNAL_MAGIC || jh->count == 0) return 0;
+    
+    const uint8_t* log = (const uint8_t*)jh + BS;
+    if (journal_committed(sb, jh, log)) {
+        for (uint32_t i = 0; i < jh->count; i++) {
+            memcpy(block_ptr(img->base, jh->target[i]), log + (size_t)i * BS, BS);
+            if (img->fd >= 0 && write_blocks(img->fd, log + (size_t)i * BS, jh->target[i], 1) != 0) {
+                return -1;
+            }
+        }
+        if (img->fd >= 0 && sync_image(img->fd) != 0) return -1;
+        printf("Replayed journal transaction %" PRIu64 " (%" PRIu32 " block(s))\n",
+               jh->sequence, jh->count);
+    }
+    
+    jh->count = 0;
+    jh->header_crc = journal_header_crc(jh);
+    if (img->fd >= 0) {
+        if (write_blocks(img->fd, (const uint8_t*)jh, sb->journal_start, 1) != 0 ||
+            sync_image(img->fd) != 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+// How data blocks are chosen for a new file. The contiguous policies fall
+// back to scattered allocation only when no free run is long enough.
+typedef enum {
+    ALLOC_SCATTER,          // first free block, one at a time
+    ALLOC_FIRST_FIT,        // first free run that fits
+    ALLOC_BEST_FIT,         // smallest free run that fits
+} alloc_policy_t;
+
+// In-memory hash index over a directory, built once when the directory is
+// first added to and reused by every add in the batch. Names map to dirent
+// slots (the index of a dirent across the directory's blocks), and free
+// slots sit on a stack, so duplicate checks and inserts no longer scan every
+// dirent.
+typedef struct {
+    uint32_t* table;        // open addressing; slot + 1 per bucket, 0 = empty
+    size_t cap;             // power of two
+    size_t count;           // used dirents, "." and ".." included
+    uint32_t* free;         // free slots, lowest on top
+    size_t free_count;
+    size_t free_cap;
+} dir_index_t;
+
+// A directory being added to: the root, or a subdirectory made by --tree.
+// Its inode CRC is finalized once per batch, and only if the inode changed.
+typedef struct {
+    inode_t* inode;
+    uint32_t ino;
+    dir_index_t index;
+    int dirty;              // inode changed since its CRC was finalized
+} dir_t;
+
+// Content index over the data blocks of regular files, for --dedup. It is
+// rebuilt on load by hashing every referenced block, which also counts how
+// many inodes share each one. Lookups key on the block's CRC32 and confirm
+// with memcmp, so a collision never merges different blocks. A remove from
+// an image with shared blocks needs the counts alone, without the index.
+typedef struct {
+    uint32_t crc;
+    uint32_t block;         // 0 = empty bucket
+} dedup_entry_t;
+
+typedef struct {
+    uint32_t* refs;         // refs[i]: references to data_region_start + i; NULL until needed
+    int on;                 // --dedup: new files share blocks through the index
+    dedup_entry_t* table;   // open addressing
+    size_t cap;             // power of two
+    size_t count;
+    uint64_t logical;       // data blocks added this batch
+    uint64_t shared;        // ... of which point at an existing block
+} dedup_t;
+
+// A loaded filesystem plus the pointers into it that every add needs. The
+// superblock CRC is patched in place when a field changes.
+typedef struct {
+    image_t img;
+    superblock_t* sb;
+    bitmap_t inodes;        // inode bitmap, bit i = inode i+1
+    bitmap_t blocks;        // data bitmap, bit i = data_region_start + i
+    bitmap_t dir_blocks;    // bit i set: data_region_start + i holds dirents
+    free_map_t free_map;    // free runs of the data bitmap
+    uint32_t* deferred;     // data bitmap bits freed by removes, cleared at commit
+    size_t deferred_count;
+    size_t deferred_cap;
+    inode_t* inode_table;
+    dir_t root;
+    dir_t* subdir;          // the --tree directory being filled, if any
+    dedup_t dedup;
+    alloc_policy_t policy;
+    atomic_int zero_copy;   // fill data blocks with copy_file_range (in place only)
+    uint64_t now;           // --epoch, SOURCE_DATE_EPOCH or the clock
+    int added;              // files and directories added since the image was opened
+    int removed;            // ... and removed
+    int sb_dirty;           // superblock block needs flushing
+    int stats;              // print CRC work per add (--stats)
+    int compress;           // store files as LZ4 chunks when that saves blocks (--compress)
+} fs_t;
+
+// Set superblock flags, patching the stored CRC over the 4-byte field
+// instead of rehashing the whole 4092-byte block. The checksum field is
+// hashed as zero, so the patch holds regardless of its current value.
+static void superblock_set_flags(fs_t* fs, uint32_t flags) {
+    superblock_t* sb = fs->sb;
+    if (sb->flags == flags) return;
+    uint32_t old = sb->flags;
+    sb->flags = flags;
+    sb->checksum = crc32_patch(sb->checksum, BS - 4, offsetof(superblock_t, flags),
+                               &old, &flags, sizeof(flags));
+    fs->sb_dirty = 1;
+}
+
+// Blocks whose old contents may be live and must change atomically:
+// everything before the data region plus directory blocks. A subdirectory
+// made earlier in the batch may already have been committed. New data and
+// indirect blocks are unreachable until those are committed.
+static int is_metadata_block(const fs_t* fs, uint64_t block) {
+    if (block < fs->sb->data_region_start) return 1;
+    return block < fs->sb->data_region_start + fs->sb->data_region_blocks &&
+           bitmap_test(&fs->dir_blocks, block - fs->sb->data_region_start);
+}
+
+// Metadata blocks waiting in the dirty list
+static size_t journal_pending(fs_t* fs) {
+    image_sort_dirty(&fs->img);
+    size_t n = 0;
+    for (size_t i = 0; i < fs->img.dirty_count; i++) {
+        n += is_metadata_block(fs, fs->img.dirty[i]);
+    }
+    return n;
+}
+
+// Write the dirty blocks of a journaled image back to the file:
+//   1. data blocks go straight home and metadata block images to the log,
+//      then fdatasync. Nothing references the new data yet, so a crash here
+//      only loses the uncommitted adds.
+//   2. the header naming each logged block's home is written and synced;
+//      from here on the update survives a crash and is replayed on open
+//   3. the metadata blocks are checkpointed in place and synced
+//   4. the header is cleared without a sync: replaying the transaction again
+//      rewrites the same blocks, and the next commit overwrites it anyway
+static int journal_commit(fs_t* fs) {
+    image_t* img = &fs->img;
+    const superblock_t* sb = fs->sb;
+    journal_header_t* jh = journal_header(img);
+    
+    if (journal_pending(fs) > journal_capacity(sb)) {
+        fprintf(stderr, "Error: update needs more than %zu journal blocks\n", journal_capacity(sb));
+        return -1;
+    }
+    
+    uint32_t count = 0;
+    uint32_t crc = 0xFFFFFFFFu;
+    size_t i = 0;
+    while (i < img->dirty_count) {
+        uint64_t block = img->dirty[i];
+        if (is_metadata_block(fs, block)) {
+            const uint8_t* src = block_ptr(img->base, block);
+            crc = crc32_update(crc, src, BS);
+            if (write_blocks(img->fd, src, sb->journal_start + 1 + count, 1) != 0) return -1;
+            jh->target[count++] = block;
+            i++;
+            continue;
+        }
+        
+        // Data: write runs of adjacent blocks in one go
+        size_t run = 1;
+        while (i + run < img->dirty_count && img->dirty[i + run] == block + run &&
+               !is_metadata_block(fs, block + run)) {
+            run++;
+        }
+        if (write_blocks(img->fd, block_ptr(img->base, block), block, run) != 0) return -1;
+        i += run;
+    }
+    if (sync_image(img->fd) != 0) return -1;
+    
+    if (count > 0) {
+        jh->magic = JOURNAL_MAGIC;
+        jh->sequence++;
+        jh->count = count;
+        jh->payload_crc = crc ^ 0xFFFFFFFFu;
+        jh->header_crc = journal_header_crc(jh);
+        if (write_blocks(img->fd, (const uint8_t*)jh, sb->journal_start, 1) != 0 ||
+            sync_image(img->fd) != 0) {
+            return -1;
+        }
+        
+        for (uint32_t j = 0; j < count; j++) {
+            if (write_blocks(img->fd, block_ptr(img->base, jh->target[j]), jh->target[j], 1) != 0) return -1;
+        }
+        if (sync_image(img->fd) != 0) return -1;
+        
+        jh->count = 0;
+        jh->header_crc = journal_header_crc(jh);
+        if (write_blocks(img->fd, (const uint8_t*)jh, sb->journal_start, 1) != 0) return -1;
+    }
+    img->dirty_count = 0;
+    return 0;
+}
+
+// Finalize a directory inode's CRC if the batch changed it
+static int dir_finalize(fs_t* fs, dir_t* dir) {
+    if (!dir->dirty) return 0;
+    inode_crc_finalize_counted(dir->inode);
+    dir->dirty = 0;
+    return mark_dirty(&fs->img, inode_table_block(fs->sb, dir->ino));
+}
+
+// Make the changes so far durable: finalize the directory inode CRCs, then
+// flush the dirty blocks through the journal or with msync. Heap images are
+// written out by the caller.
+static int fs_commit(fs_t* fs) {
+    int rc = dir_finalize(fs, &fs->root);
+    if (fs->subdir) rc |= dir_finalize(fs, fs->subdir);
+    if (fs->sb_dirty) {
+        rc |= mark_dirty(&fs->img, 0);
+        fs->sb_dirty = 0;
+    }
+    if (rc != 0) return -1;
+    if (fs->img.fd < 0) return 0;
+    if (!fs->img.journaled) return image_sync_dirty(&fs->img);
+    
+    // Blocks freed by removes leave the bitmap with this transaction and
+    // can be reused once it is committed
+    for (size_t i = 0; i < fs->deferred_count; i++) bitmap_clear(&fs->blocks, fs->deferred[i]);
+    if (journal_commit(fs) != 0) return -1;
+    for (size_t i = 0; i < fs->deferred_count; i++) free_map_insert(&fs->free_map, fs->deferred[i], 1);
+    fs->deferred_count = 0;
+    return 0;
+}
+
+// Whether the journal could not hold both the batch so far and an add that
+// may dirty up to "need" metadata blocks. Two more blocks (the root inode's
+// table block and the superblock) may join at commit; a subdirectory's
+// inode block is counted by the caller.
+static int journal_full(fs_t* fs, size_t need) {
+    return fs->img.journaled && journal_pending(fs) + need + 2 > journal_capacity(fs->sb);
+}
+
+// Before such an add, commit the batch so far if it would not fit
+static int journal_reserve(fs_t* fs, size_t need) {
+    return journal_full(fs, need) ? fs_commit(fs) : 0;
+}
+
+#define DIRENTS_PER_BLOCK (BS / sizeof(dirent64_t))
+
+static dirent64_t* dir_slot(fs_t* fs, dir_t* dir, uint32_t slot) {
+    uint8_t* block = block_ptr(fs->img.base, dir->inode->direct[slot / DIRENTS_PER_BLOCK]);
+    return (dirent64_t*)block + slot % DIRENTS_PER_BLOCK;
+}
+
+// FNV-1a over the NUL-terminated name
+static uint32_t name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (const uint8_t* p = (const uint8_t*)name; *p; p++) h = (h ^ *p) * 16777619u;
+    return h;
+}
+
+// Slot holding "name", or -1
+static long dir_lookup(fs_t* fs, dir_t* dir, const char* name) {
+    dir_index_t* d = &dir->index;
+    for (size_t b = name_hash(name) & (d->cap - 1); d->table[b] != 0; b = (b + 1) & (d->cap - 1)) {
+        uint32_t slot = d->table[b] - 1;
+        if (strncmp(dir_slot(fs, dir, slot)->name, name, sizeof(((dirent64_t*)0)->name)) == 0) {
+            return slot;
+        }
+    }
+    return -1;
+}
+
+// Index the (already written) dirent at "slot", growing the table at 50% load
+static int dir_insert(fs_t* fs, dir_t* dir, uint32_t slot) {
+    dir_index_t* d = &dir->index;
+    if ((d->count + 1) * 2 > d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 128;
+        uint32_t* table = calloc(cap, sizeof(uint32_t));
+        if (!table) {
+            perror("calloc");
+            return -1;
+        }
+        for (size_t i = 0; i < d->cap; i++) {
+            if (d->table[i] == 0) continue;
+            size_t b = name_hash(dir_slot(fs, dir, d->table[i] - 1)->name) & (cap - 1);
+            while (table[b] != 0) b = (b + 1) & (cap - 1);
+            table[b] = d->table[i];
+        }
+        free(d->table);
+        d->table = table;
+        d->cap = cap;
+    }
+    
+    size_t b = name_hash(dir_slot(fs, dir, slot)->name) & (d->cap - 1);
+    while (d->table[b] != 0) b = (b + 1) & (d->cap - 1);
+    d->table[b] = slot + 1;
+    d->count++;
+    return 0;
+}
+
+static int dir_push_free(dir_index_t* d, uint32_t slot) {
+    if (d->free_count == d->free_cap) {
+        size_t cap = d->free_cap ? d->free_cap * 2 : DIRENTS_PER_BLOCK;
+        uint32_t* f = realloc(d->free, cap * sizeof(uint32_t));
+        if (!f) {
+            perror("realloc");
+            return -1;
+        }
+        d->free = f;
+        d->free_cap = cap;
+    }
+    d->free[d->free_count++] = slot;
+    return 0;
+}
+
+// Open directory inode "ino" for adding: build its index from its direct
+// blocks
+static int dir_open(fs_t* fs, dir_t* dir, uint32_t ino) {
+    memset(dir, 0, sizeof(*dir));
+    dir->inode = &fs->inode_table[ino - 1];
+    dir->ino = ino;
+    for (int k = DIRECT_MAX - 1; k >= 0; k--) {
+        if (dir->inode->direct[k] == 0) continue;
+        for (long e = DIRENTS_PER_BLOCK - 1; e >= 0; e--) {
+            uint32_t slot = k * DIRENTS_PER_BLOCK + e;
+            int rc = dir_slot(fs, dir, slot)->inode_no != 0 ? dir_insert(fs, dir, slot)
+                                                            : dir_push_free(&dir->index, slot);
+            if (rc != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+// Index of the first unused direct[] pointer of a directory, or DIRECT_MAX
+static int dir_next_block(const dir_t* dir) {
+    int k = 0;
+    while (k < DIRECT_MAX && dir->inode->direct[k] != 0) k++;
+    return k;
+}
+
+// Record a new directory block for is_metadata_block()
+static void dir_block_track(fs_t* fs, uint32_t block) {
+    bitmap_set(&fs->dir_blocks, block - fs->sb->data_region_start);
+}
+
+// Give a directory one more block, taken lazily from the data bitmap when
+// every existing slot is used. Its dirents go on the free stack, so inserts
+// never revisit full blocks.
+static int dir_grow(fs_t* fs, dir_t* dir) {
+    int k = dir_next_block(dir);
+    if (k == DIRECT_MAX) return -1;
+    
+    long bit = free_map_alloc(&fs->free_map, 1, 0);
+    if (bit < 0) return -1;
+    
+    uint32_t block = fs->sb->data_region_start + bit;
+    memset(block_ptr(fs->img.base, block), 0, BS);
+    for (long e = DIRENTS_PER_BLOCK - 1; e >= 0; e--) {
+        if (dir_push_free(&dir->index, k * DIRENTS_PER_BLOCK + e) != 0) {
+            dir->index.free_count = 0;
+            free_map_release(&fs->free_map, bit);
+            return -1;
+        }
+    }
+    dir->inode->direct[k] = block;
+    dir->dirty = 1;
+    dir_block_track(fs, block);
+    
+    int rc = mark_dirty(&fs->img, block);
+    rc |= mark_dirty(&fs->img, bitmap_block_of(fs->sb->data_bitmap_start, bit));
+    return rc;
+}
+
+static void dir_index_free(dir_index_t* d) {
+    free(d->table);
+    free(d->free);
+    memset(d, 0, sizeof(*d));
+}
+
+// Take the lowest free dirent slot of "dir"; the caller has made sure one
+// exists
+static uint32_t dir_take_slot(dir_t* dir) {
+    return dir->index.free[--dir->index.free_count];
+}
+
+// Undo the last dir_grow(): the new block's slots are on top of the free
+// stack again
+static void dir_shrink(fs_t* fs, dir_t* dir) {
+    int k = dir_next_block(dir) - 1;
+    uint32_t bit = dir->inode->direct[k] - fs->sb->data_region_start;
+    free_map_release(&fs->free_map, bit);
+    bitmap_clear(&fs->dir_blocks, bit);
+    dir->inode->direct[k] = 0;
+    dir->index.free_count -= DIRENTS_PER_BLOCK;
+}
+
+// Fill dirent "slot" of "dir" (from dir_take_slot) with "name" -> inode
+// index "idx" (0-based) and grow the directory's size to match
+static int dir_link(fs_t* fs, dir_t* dir, uint32_t slot, const char* name, long idx, uint8_t type) {
+    dirent64_t* de = dir_slot(fs, dir, slot);
+    de->inode_no = idx + 1; // 1-indexed
+    de->type = type;
+    memset(de->name, 0, 58);
+    strncpy(de->name, name, 57);
+    de->name[57] = '\0'; // Ensure null termination
+    dirent_checksum_finalize(de);
+    
+    // Only the size changes as one more entry goes in. The CRC is
+    // finalized once the whole batch is in.
+    dir->inode->size_bytes = (dir->index.count + 1) * sizeof(dirent64_t);
+    dir->inode->mtime = fs->now;
+    dir->dirty = 1;
+    
+    if (dir_insert(fs, dir, slot) != 0) return -1;
+    return mark_dirty(&fs->img, dir->inode->direct[slot / DIRENTS_PER_BLOCK]);
+}
+
+// Clear dirent "slot" of "dir" and shrink the directory's size to match. The
+// slot goes back on the free stack in order, so adds still take the lowest.
+static int dir_unlink(fs_t* fs, dir_t* dir, uint32_t slot) {
+    dir_index_t* d = &dir->index;
+    if (dir_push_free(d, slot) != 0) return -1;
+    size_t i = d->free_count - 1;
+    for (; i > 0 && d->free[i - 1] < slot; i--) d->free[i] = d->free[i - 1];
+    d->free[i] = slot;
+    
+    // Unindex it, shifting later entries of its probe run back so they stay
+    // reachable
+    size_t mask = d->cap - 1;
+    size_t b = name_hash(dir_slot(fs, dir, slot)->name) & mask;
+    while (d->table[b] != slot + 1) b = (b + 1) & mask;
+    for (size_t j = (b + 1) & mask; d->table[j] != 0; j = (j + 1) & mask) {
+        size_t home = name_hash(dir_slot(fs, dir, d->table[j] - 1)->name) & mask;
+        if (((j - home) & mask) >= ((j - b) & mask)) {
+            d->table[b] = d->table[j];
+            b = j;
+        }
+    }
+    d->table[b] = 0;
+    d->count--;
+    
+    memset(dir_slot(fs, dir, slot), 0, sizeof(dirent64_t));
+    dir->inode->size_bytes = d->count * sizeof(dirent64_t);
+    dir->inode->mtime = fs->now;
+    dir->dirty = 1;
+    return mark_dirty(&fs->img, dir->inode->direct[slot / DIRENTS_PER_BLOCK]);
+}
+
+// Copy up to len bytes of src_fd into the image file inside the kernel, with
+// no user-space buffer. Returns the number of bytes copied, which is short
+// when the kernel cannot copy between these two files; the caller finishes
+// the rest through the buffered path.
+static ssize_t copy_zero_copy(fs_t* fs, int src_fd, off_t src_off, off_t dst_off, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        loff_t in = src_off + done, out = dst_off + done;
+        ssize_t n = copy_file_range(src_fd, &in, fs->img.fd, &out, len - done, 0);
+        if (n > 0) {
+            done += n;
+            continue;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0 && errno != EXDEV && errno != ENOSYS && errno != EINVAL &&
+            errno != EOPNOTSUPP && errno != EBADF) {
+            return -1;
+        }
+        // Not supported for this pair of files (or EOF): stop trying
+        fs->zero_copy = 0;
+        break;
+    }
+    return done;
+}
+
+// Fill a file's data blocks from src_fd, one extent (run of consecutive
+// blocks) at a time, and zero the tail of the last block. In place, extents
+// are copied file-to-file with copy_file_range; otherwise, or when that is
+// unsupported, they are pread straight into the image buffer.
+static int copy_file_data(fs_t* fs, int src_fd, size_t file_size,
+                          const uint32_t* data_blocks, size_t blocks_needed) {
+    size_t i = 0;
+    while (i < blocks_needed) {
+        size_t first = i;
+        while (++i < blocks_needed && data_blocks[i] == data_blocks[i - 1] + 1) {
+        }
+        
+        size_t file_off = first * BS;
+        size_t len = (i == blocks_needed ? file_size : i * BS) - file_off;
+        off_t dst_off = (off_t)block_offset(data_blocks[first]);
+        size_t done = 0;
+        
+        if (fs->img.fd >= 0 && fs->zero_copy) {
+            ssize_t n = copy_zero_copy(fs, src_fd, file_off, dst_off, len);
+            if (n < 0) return -1;
+            done = n;
+            
+            // In a MAP_PRIVATE mapping a block written earlier in this run
+            // (then freed by --dedup and reused here) keeps its private page,
+            // which would hide the copied data and be flushed over it on
+            // commit. Dropping the pages makes the mapping read the file.
+            if (fs->img.journaled && done > 0 &&
+                madvise(fs->img.base + dst_off, (done + BS - 1) / BS * BS, MADV_DONTNEED) != 0) {
+                perror("madvise");
+                return -1;
+            }
+        }
+        
+        // Blocks filled through the mapping must be flushed on commit. So must
+        // zero-copied ones in a shared mapping, where msync is what makes them
+        // durable; a journaled commit fdatasyncs the whole file instead.
+        size_t skip = fs->img.journaled ? done / BS : 0;
+        for (size_t k = first + skip; k < i; k++) {
+            if (mark_dirty(&fs->img, data_blocks[k]) != 0) return -1;
+        }
+        
+        while (done < len) {
+            ssize_t n = pread(src_fd, fs->img.base + dst_off + done, len - done, file_off + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) return -1;
+            done += n;
+        }
+    }
+    
+    // Zero-pad the last block if needed
+    size_t tail = file_size % BS;
+    if (tail != 0) {
+        uint8_t* last = block_ptr(fs->img.base, data_blocks[blocks_needed - 1]);
+        memset(last + tail, 0, BS - tail);
+    }
+    return 0;
+}
+
+// Number of indirect blocks needed to map "n" data blocks: one single-indirect
+// block past the direct pointers, then one double-indirect block plus one
+// second-level block per PTRS_PER_BLOCK data blocks.
+static size_t map_blocks_for(size_t n) {
+    if (n <= DIRECT_MAX) return 0;
+    n -= DIRECT_MAX;
+    if (n <= PTRS_PER_BLOCK) return 1;
+    n -= PTRS_PER_BLOCK;
+    return 2 + (n + PTRS_PER_BLOCK - 1) / PTRS_PER_BLOCK;
+}
+
+// The blocks backing one file. They are allocated in on-disk layout order:
+// the direct data blocks, the single-indirect block followed by the data it
+// maps, then the double-indirect block and each second-level block followed
+// by its data. With a contiguous policy the indirect blocks therefore sit
+// right next to the data they describe.
+typedef struct {
+    long* bits;             // data bitmap bits in layout order
+    size_t total;           // data + indirect blocks
+    uint32_t* data;         // absolute data block numbers in file order
+    size_t data_count;
+    uint32_t indirect;      // single-indirect block, 0 if unused
+    uint32_t double_indirect;
+} file_blocks_t;
+
+static void file_blocks_release(fs_t* fs, file_blocks_t* fb) {
+    for (size_t j = 0; j < fb->total; j++) free_map_release(&fs->free_map, fb->bits[j]);
+    free(fb->bits);
+    free(fb->data);
+    memset(fb, 0, sizeof(*fb));
+}
+
+// Allocate and lay out the blocks for a file of "data_count" blocks, and
+// write the indirect blocks' pointers. Returns -1 (nothing allocated) when
+// the data region is full.
+static int file_blocks_alloc(fs_t* fs, size_t data_count, file_blocks_t* fb) {
+    memset(fb, 0, sizeof(*fb));
+    if (data_count == 0) return 0;
+    
+    size_t total = data_count + map_blocks_for(data_count);
+    fb->bits = malloc(total * sizeof(long));
+    fb->data = malloc(data_count * sizeof(uint32_t));
+    if (!fb->bits || !fb->data) {
+        perror("malloc");
+        file_blocks_release(fs, fb);
+        return -1;
+    }
+    fb->data_count = data_count;
+    
+    // Take one contiguous run per the allocation policy, otherwise fall back
+    // to block-by-block
+    long run = -1;
+    if (fs->policy != ALLOC_SCATTER) {
+        run = free_map_alloc(&fs->free_map, total, fs->policy == ALLOC_BEST_FIT);
+    }
+    for (size_t j = 0; j < total; j++) {
+        long bit = run >= 0 ? run + (long)j : free_map_alloc(&fs->free_map, 1, 0);
+        if (bit == -1) {
+            file_blocks_release(fs, fb);
+            return -1;
+        }
+        fb->bits[j] = bit;
+        fb->total++;
+    }
+    
+    // Walk the layout, handing out data blocks and filling in pointer blocks
+    int rc = 0;
+    uint32_t* ind = NULL;
+    uint32_t* dind = NULL;
+    uint32_t* l2 = NULL;
+    size_t p = 0;
+    for (size_t i = 0; i < data_count; i++) {
+        if (i == DIRECT_MAX) {
+            fb->indirect = fs->sb->data_region_start + fb->bits[p++];
+            ind = (uint32_t*)block_ptr(fs->img.base, fb->indirect);
+            memset(ind, 0, BS);
+            rc |= mark_dirty(&fs->img, fb->indirect);
+        }
+        if (i >= DIRECT_MAX + PTRS_PER_BLOCK && (i - DIRECT_MAX) % PTRS_PER_BLOCK == 0) {
+            if (i == DIRECT_MAX + PTRS_PER_BLOCK) {
+                fb->double_indirect = fs->sb->data_region_start + fb->bits[p++];
+                dind = (uint32_t*)block_ptr(fs->img.base, fb->double_indirect);
+                memset(dind, 0, BS);
+                rc |= mark_dirty(&fs->img, fb->double_indirect);
+            }
+            uint32_t l2_block = fs->sb->data_region_start + fb->bits[p++];
+            dind[(i - DIRECT_MAX - PTRS_PER_BLOCK) / PTRS_PER_BLOCK] = l2_block;
+            l2 = (uint32_t*)block_ptr(fs->img.base, l2_block);
+            memset(l2, 0, BS);
+            rc |= mark_dirty(&fs->img, l2_block);
+        }
+        
+        uint32_t block = fs->sb->data_region_start + fb->bits[p++];
+        fb->data[i] = block;
+        if (i >= DIRECT_MAX + PTRS_PER_BLOCK) {
+            l2[(i - DIRECT_MAX) % PTRS_PER_BLOCK] = block;
+        } else if (i >= DIRECT_MAX) {
+            ind[i - DIRECT_MAX] = block;
+        }
+    }
+    if (rc != 0) {
+        file_blocks_release(fs, fb);
+        return -1;
+    }
+    return 0;
+}
+
+// Physical block backing logical block "i" of an existing inode, 0 if the
+// map is unset or points outside the data region
+static uint32_t inode_block(const fs_t* fs, const inode_t* inode, uint64_t i) {
+    const superblock_t* sb = fs->sb;
+    uint32_t block;
+    if (i < DIRECT_MAX) {
+        block = inode->direct[i];
+    } else if ((i -= DIRECT_MAX) < PTRS_PER_BLOCK) {
+        if (inode->indirect < sb->data_region_start || inode->indirect >= sb->total_blocks) return 0;
+        block = ((const uint32_t*)block_ptr(fs->img.base, inode->indirect))[i];
+    } else {
+        i -= PTRS_PER_BLOCK;
+        if (i >= (uint64_t)PTRS_PER_BLOCK * PTRS_PER_BLOCK) return 0;
+        uint32_t map = inode->double_indirect;
+        if (map < sb->data_region_start || map >= sb->total_blocks) return 0;
+        map = ((const uint32_t*)block_ptr(fs->img.base, map))[i / PTRS_PER_BLOCK];
+        if (map < sb->data_region_start || map >= sb->total_blocks) return 0;
+        block = ((const uint32_t*)block_ptr(fs->img.base, map))[i % PTRS_PER_BLOCK];
+    }
+    return block >= sb->data_region_start && block < sb->total_blocks ? block : 0;
+}
+
+// Number of data blocks an existing file occupies: ceil(size / BS), or for a
+// compressed file the count in its chunk map
+static uint64_t inode_data_blocks(const fs_t* fs, const inode_t* inode) {
+    uint64_t n = (inode->size_bytes + BS - 1) / BS;
+    if (!(inode->iflags & INODE_FLAG_COMPRESSED) || n == 0) return n;
+    uint32_t map = inode_block(fs, inode, 0);
+    if (map == 0) return 0;
+    uint64_t stored = ((const chunk_map_t*)block_ptr(fs->img.base, map))->stored_blocks;
+    return stored < n ? stored : n;
+}
+
+static int dedup_insert(dedup_t* d, uint32_t crc, uint32_t block) {
+    if ((d->count + 1) * 2 > d->cap) {
+        size_t cap = d->cap ? d->cap * 2 : 1024;
+        dedup_entry_t* table = calloc(cap, sizeof(dedup_entry_t));
+        if (!table) {
+            perror("calloc");
+            return -1;
+        }
+        for (size_t b = 0; b < d->cap; b++) {
+            if (d->table[b].block == 0) continue;
+            size_t n = d->table[b].crc & (cap - 1);
+            while (table[n].block != 0) n = (n + 1) & (cap - 1);
+            table[n] = d->table[b];
+        }
+        free(d->table);
+        d->table = table;
+        d->cap = cap;
+    }
+    size_t b = crc & (d->cap - 1);
+    while (d->table[b].block != 0) b = (b + 1) & (d->cap - 1);
+    d->table[b].crc = crc;
+    d->table[b].block = block;
+    d->count++;
+    return 0;
+}
+
+// An indexed block with the same contents as "data", or 0. Blocks freed by
+// a remove keep their entry but have no references left.
+static uint32_t dedup_find(const fs_t* fs, uint32_t crc, const uint8_t* data) {
+    const dedup_t* d = &fs->dedup;
+    if (d->cap == 0) return 0;
+    for (size_t b = crc & (d->cap - 1); d->table[b].block != 0; b = (b + 1) & (d->cap - 1)) {
+        if (d->table[b].crc == crc && d->refs[d->table[b].block - fs->sb->data_region_start] != 0 &&
+            memcmp(block_ptr(fs->img.base, d->table[b].block), data, BS) == 0) {
+            return d->table[b].block;
+        }
+    }
+    return 0;
+}
+
+// Count one more reference to an existing data block, indexing it on the
+// first with --dedup
+static int dedup_track(fs_t* fs, uint32_t block) {
+    if (fs->dedup.refs[block - fs->sb->data_region_start]++ != 0 || !fs->dedup.on) return 0;
+    const uint8_t* data = block_ptr(fs->img.base, block);
+    return dedup_insert(&fs->dedup, crc32(data, BS), block);
+}
+
+// Build the reference counts, and with --dedup the content index, from every
+// regular file
+static int dedup_build(fs_t* fs) {
+    fs->dedup.refs = calloc(fs->sb->data_region_blocks, sizeof(uint32_t));
+    if (!fs->dedup.refs) {
+        perror("calloc");
+        return -1;
+    }
+    for (uint64_t ino = 0; ino < fs->sb->inode_count; ino++) {
+        const inode_t* inode = &fs->inode_table[ino];
+        if (!bitmap_test(&fs->inodes, ino) || inode->mode != 0100000) continue;
+        uint64_t n = inode_data_blocks(fs, inode);
+        for (uint64_t i = 0; i < n; i++) {
+            uint32_t block = inode_block(fs, inode, i);
+            if (block != 0 && dedup_track(fs, block) != 0) return -1;
+        }
+    }
+    return 0;
+}
+
+static void dedup_free(dedup_t* d) {
+    free(d->refs);
+    free(d->table);
+    memset(d, 0, sizeof(*d));
+}
+
+// Point each freshly written data block of a new file that duplicates an
+// indexed block at that block instead, and release the fresh copy. Unique
+// blocks join the index, so later blocks (of this file too) can share them.
+// Returns the number of blocks shared, or -1.
+static long dedup_file(fs_t* fs, file_blocks_t* fb) {
+    long shared = 0;
+    uint32_t drs = fs->sb->data_region_start;
+    for (size_t i = 0; i < fb->data_count; i++) {
+        uint32_t block = fb->data[i];
+        const uint8_t* data = block_ptr(fs->img.base, block);
+        uint32_t crc = crc32(data, BS);
+        uint32_t match = dedup_find(fs, crc, data);
+        if (match == 0) {
+            if (dedup_insert(&fs->dedup, crc, block) != 0) return -1;
+            fs->dedup.refs[block - drs] = 1;
+            continue;
+        }
+        
+        fs->dedup.refs[match - drs]++;
+        fb->data[i] = match;
+        if (i >= DIRECT_MAX + PTRS_PER_BLOCK) {
+            size_t j = i - DIRECT_MAX - PTRS_PER_BLOCK;
+            const uint32_t* dind = (const uint32_t*)block_ptr(fs->img.base, fb->double_indirect);
+            ((uint32_t*)block_ptr(fs->img.base, dind[j / PTRS_PER_BLOCK]))[j % PTRS_PER_BLOCK] = match;
+        } else if (i >= DIRECT_MAX) {
+            ((uint32_t*)block_ptr(fs->img.base, fb->indirect))[i - DIRECT_MAX] = match;
+        }
+        
+        free_map_release(&fs->free_map, block - drs);
+        shared++;
+    }
+    
+    // Drop the released copies from the file's blocks, keeping layout order
+    if (shared > 0) {
+        size_t kept = 0;
+        for (size_t j = 0; j < fb->total; j++) {
+            if (bitmap_test(&fs->blocks, fb->bits[j])) fb->bits[kept++] = fb->bits[j];
+        }
+        fb->total = kept;
+    }
+    fs->dedup.logical += fb->data_count;
+    fs->dedup.shared += shared;
+    return shared;
+}
+
+// A file packed for --compress: its chunk map followed by its chunks, each
+// padded to whole blocks, exactly as they are laid out on disk
+typedef struct {
+    uint8_t* buf;
+    size_t blocks;
+    size_t cap;             // blocks allocated in buf
+} packed_file_t;
+
+// Grow buf to hold "blocks" blocks; new space reads as zeros
+static int packed_reserve(packed_file_t* pf, size_t blocks) {
+    if (blocks <= pf->cap) return 0;
+    size_t cap = pf->cap ? pf->cap : 16;
+    while (cap < blocks) cap *= 2;
+    uint8_t* buf = realloc(pf->buf, cap * BS);
+    if (!buf) {
+        perror("realloc");
+        return -1;
+    }
+    memset(buf + pf->cap * BS, 0, (cap - pf->cap) * BS);
+    pf->buf = buf;
+    pf->cap = cap;
+    return 0;
+}
+
+static void packed_free(packed_file_t* pf) {
+    free(pf->buf);
+    memset(pf, 0, sizeof(*pf));
+}
+
+// Compress a file one CHUNK_BYTES chunk at a time. A chunk that does not
+// shrink by at least a block is kept raw. Returns 1 with the packed form in
+// *pf when it takes fewer blocks than the raw file, 0 when the file is
+// better stored raw, -1 on error.
+static int compress_file(int src_fd, size_t file_size, packed_file_t* pf) {
+    size_t raw_blocks = (file_size + BS - 1) / BS;
+    size_t chunks = (file_size + CHUNK_BYTES - 1) / CHUNK_BYTES;
+    size_t map_blocks = (sizeof(chunk_map_t) + chunks * sizeof(chunk_entry_t) + BS - 1) / BS;
+    memset(pf, 0, sizeof(*pf));
+    if (map_blocks >= raw_blocks) return 0;
+    
+    size_t packed_cap = lz4_bound(CHUNK_BYTES);
+    uint8_t* raw = malloc(CHUNK_BYTES);
+    uint8_t* packed = malloc(packed_cap);
+    int rc = raw && packed && packed_reserve(pf, map_blocks) == 0 ? 1 : -1;
+    pf->blocks = map_blocks;
+    
+    for (size_t c = 0; c < chunks && rc == 1; c++) {
+        size_t off = c * CHUNK_BYTES;
+        size_t len = file_size - off < CHUNK_BYTES ? file_size - off : CHUNK_BYTES;
+        size_t done = 0;
+        while (done < len) {
+            ssize_t n = pread(src_fd, raw + done, len - done, off + done);
+            if (n < 0 && errno == EINTR) continue;
+            if (n <= 0) break;
+            done += n;
+        }
+        if (done < len) {
+            rc = -1;
+            break;
+        }
+        
+        size_t clen = lz4_compress(raw, len, packed, packed_cap);
+        size_t blocks = (clen + BS - 1) / BS;
+        const uint8_t* src = packed;
+        if (clen == 0 || blocks >= (len + BS - 1) / BS) {
+            clen = 0;
+            blocks = (len + BS - 1) / BS;
+            src = raw;
+        }
+        if (pf->blocks + blocks >= raw_blocks) {
+            rc = 0;
+            break;
+        }
+        if (packed_reserve(pf, pf->blocks + blocks) != 0) {
+            rc = -1;
+            break;
+        }
+        memcpy(pf->buf + pf->blocks * BS, src, clen ? clen : len);
+        
+        chunk_map_t* map = (chunk_map_t*)pf->buf;
+        map->chunk[c].block = (uint32_t)pf->blocks;
+        map->chunk[c].clen = (uint32_t)clen;
+        pf->blocks += blocks;
+    }
+    
+    free(raw);
+    free(packed);
+    if (rc != 1) {
+        packed_free(pf);
+        return rc;
+    }
+    chunk_map_t* map = (chunk_map_t*)pf->buf;
+    map->stored_blocks = (uint32_t)pf->blocks;
+    map->chunk_count = (uint32_t)chunks;
+    return 1;
+}
+
+// The contents of a file being added. A --tree reader thread loads small
+// files ahead of the writer, into "packed" when --compress pays off and
+// into "raw" otherwise; other files are read from "fd" as their blocks are
+// filled.
+typedef struct {
+    size_t size;
+    packed_file_t packed;   // compressed form, buf NULL if none
+    uint8_t* raw;           // contents zero-padded to whole blocks, or NULL
+    int fd;                 // host file, -1 when loaded or empty
+} file_data_t;
+
+static void file_data_free(file_data_t* data) {
+    packed_free(&data->packed);
+    free(data->raw);
+    data->raw = NULL;
+}
+
+// What one add placed in the image, for the per-file report
+typedef struct {
+    size_t blocks;          // data + indirect blocks
+    size_t extents;         // runs of consecutive blocks
+    size_t raw_blocks;      // data blocks of the uncompressed file
+    size_t stored_blocks;   // data blocks written, fewer when compressed
+    long shared;            // blocks shared with existing data (--dedup)
+} add_result_t;
+
+// Files are limited to the direct + single- + double-indirect blocks
+static int check_file_size(const char* path, size_t file_size) {
+    size_t max_file_size = (DIRECT_MAX + PTRS_PER_BLOCK + PTRS_PER_BLOCK * PTRS_PER_BLOCK) * (size_t)BS;
+    if (file_size > max_file_size) {
+        fprintf(stderr, "Error: file '%s' too large (max %zu bytes)\n", path, max_file_size);
+        return -1;
+    }
+    return 0;
+}
+
+// Checks shared by every add into "dir": the name fits and is new, the
+// directory can take one more entry and an inode is free. They run before
+// any allocation so a rejected add leaves an in-place image untouched.
+// Returns the free inode's index, or -1.
+static long add_prepare(fs_t* fs, dir_t* dir, const char* name) {
+    // Check filename length (must fit in 58 characters including null terminator)
+    if (strlen(name) > 57) {
+        fprintf(stderr, "Error: filename '%s' too long (max 57 characters)\n", name);
+        return -1;
+    }
+    
+    if (dir_lookup(fs, dir, name) >= 0) {
+        fprintf(stderr, "Error: file '%s' already exists in filesystem\n", name);
+        return -1;
+    }
+    
+    if (dir->index.free_count == 0 && dir_next_block(dir) == DIRECT_MAX) {
+        if (dir == &fs->root) {
+            fprintf(stderr, "Error: root directory full\n");
+        } else {
+            fprintf(stderr, "Error: directory full, cannot add '%s'\n", name);
+        }
+        return -1;
+    }
+    
+    long free_inode = bitmap_find_free(&fs->inodes);
+    if (free_inode == -1) {
+        fprintf(stderr, "Error: no free inodes\n");
+        return -1;
+    }
+    return free_inode;
+}
+
+// A file whose inode, blocks and dirent slot are reserved but not yet
+// filled or linked
+typedef struct {
+    long inode;             // inode index (from add_prepare)
+    uint32_t slot;          // dirent slot in the target directory
+    int grew;               // the directory gained a block for this file
+    size_t blocks_needed;   // data blocks of the raw file
+    size_t stored_blocks;   // data blocks to fill, fewer when compressed
+    file_blocks_t fb;
+} reserved_file_t;
+
+// Journal blocks an add of a "blocks_needed"-block file may dirty: the inode
+// bitmap and table blocks, the superblock, two directory blocks, the data
+// bitmap blocks the file's blocks can span and a subdirectory's inode block
+static size_t journal_need(const fs_t* fs, const dir_t* dir, size_t blocks_needed) {
+    uint64_t bitmap_span = (blocks_needed + map_blocks_for(blocks_needed)) / BITS_PER_BITMAP_BLOCK + 2;
+    if (bitmap_span > fs->sb->data_bitmap_blocks) bitmap_span = fs->sb->data_bitmap_blocks;
+    return 5 + bitmap_span + (dir != &fs->root);
+}
+
+// Give back a reservation. Reservations are undone newest first.
+static void unreserve_file(fs_t* fs, dir_t* dir, reserved_file_t* rf) {
+    bitmap_clear(&fs->inodes, rf->inode);
+    dir->index.free[dir->index.free_count++] = rf->slot;
+    if (rf->grew) dir_shrink(fs, dir);
+    file_blocks_release(fs, &rf->fb);
+}
+
+// Allocate everything a file needs in "dir", in the order a plain add has
+// always used: its blocks, then a directory block if every slot is taken,
+// then the dirent slot and inode. Records the metadata blocks it touches.
+static int reserve_file(fs_t* fs, dir_t* dir, long free_inode, const file_data_t* data,
+                        reserved_file_t* rf) {
+    superblock_t* sb = fs->sb;
+    memset(rf, 0, sizeof(*rf));
+    rf->inode = free_inode;
+    rf->blocks_needed = (data->size + BS - 1) / BS;
+    rf->stored_blocks = data->packed.buf ? data->packed.blocks : rf->blocks_needed;
+    
+    // Allocate data blocks (only if file is not empty) and the indirect
+    // blocks that map anything past the direct pointers
+    if (file_blocks_alloc(fs, rf->stored_blocks, &rf->fb) != 0) {
+        fprintf(stderr, "Error: no free data blocks\n");
+        return -1;
+    }
+    
+    // Grow the directory if all of its blocks are full
+    if (dir->index.free_count == 0) {
+        if (dir_grow(fs, dir) != 0) {
+            fprintf(stderr, "Error: no free data blocks for directory\n");
+            file_blocks_release(fs, &rf->fb);
+            return -1;
+        }
+        rf->grew = 1;
+    }
+    rf->slot = dir_take_slot(dir);
+    bitmap_set(&fs->inodes, free_inode);
+    
+    // Record the metadata blocks this add touches for an in-place flush; the
+    // pointer and directory blocks were recorded as they were set up
+    int rc = mark_dirty(&fs->img, bitmap_block_of(sb->inode_bitmap_start, free_inode));
+    rc |= mark_dirty(&fs->img, inode_table_block(sb, (uint32_t)free_inode + 1));
+    rc |= mark_dirty(&fs->img, dir->inode->direct[rf->slot / DIRENTS_PER_BLOCK]);
+    for (size_t j = 0; j < rf->fb.total; j++) {
+        rc |= mark_dirty(&fs->img, bitmap_block_of(sb->data_bitmap_start, rf->fb.bits[j]));
+    }
+    if (rc != 0) {
+        unreserve_file(fs, dir, rf);
+        return -1;
+    }
+    return 0;
+}
+
+// Copy the content to the reserved blocks: from memory if it was packed or
+// loaded ahead, otherwise straight from the host file. Safe to run for
+// several files at once.
+static int fill_file(fs_t* fs, const file_data_t* data, const reserved_file_t* rf) {
+    const uint8_t* loaded = data->packed.buf ? data->packed.buf : data->raw;
+    if (loaded) {
+        int rc = 0;
+        for (size_t i = 0; i < rf->stored_blocks; i++) {
+            memcpy(block_ptr(fs->img.base, rf->fb.data[i]), loaded + i * BS, BS);
+            rc |= mark_dirty(&fs->img, rf->fb.data[i]);
+        }
+        return rc;
+    }
+    if (rf->blocks_needed == 0) return 0;
+    return copy_file_data(fs, data->fd, data->size, rf->fb.data, rf->blocks_needed);
+}
+
+// Write the inode of a filled reservation and link it into "dir" as
+// "name". Fails only when out of memory.
+static int finish_file(fs_t* fs, dir_t* dir, const char* name, const file_data_t* data,
+                       reserved_file_t* rf, add_result_t* res) {
+    superblock_t* sb = fs->sb;
+    file_blocks_t* fb = &rf->fb;
+    
+    // Share blocks whose contents are already in the image. If the index
+    // cannot grow it may now name blocks that are about to be released, so
+    // it is dropped for the rest of the batch.
+    long shared = 0;
+    if (fs->dedup.on && (shared = dedup_file(fs, fb)) < 0) {
+        fprintf(stderr, "Error: out of memory for the dedup index\n");
+        dedup_free(&fs->dedup);
+        unreserve_file(fs, dir, rf);
+        return -1;
+    }
+    
+    // Create new inode
+    inode_t* new_inode = &fs->inode_table[rf->inode];
+    memset(new_inode, 0, sizeof(inode_t));
+    
+    new_inode->mode = 0100000;  // Regular file
+    new_inode->links = 1;
+    new_inode->uid = 0;
+    new_inode->gid = 0;
+    new_inode->size_bytes = data->size;
+    new_inode->atime = fs->now;
+    new_inode->mtime = fs->now;
+    new_inode->ctime = fs->now;
+    
+    // Set direct and indirect block pointers
+    for (size_t i = 0; i < fb->data_count && i < DIRECT_MAX; i++) {
+        new_inode->direct[i] = fb->data[i];
+    }
+    new_inode->indirect = fb->indirect;
+    new_inode->double_indirect = fb->double_indirect;
+    
+    // Images with indirect blocks are only readable by tools that know them
+    if (fb->indirect != 0) superblock_set_flags(fs, sb->flags | SB_FLAG_INDIRECT);
+    if (shared > 0) superblock_set_flags(fs, sb->flags | SB_FLAG_DEDUP);
+    if (rf->stored_blocks < rf->blocks_needed) {
+        new_inode->iflags = INODE_FLAG_COMPRESSED;
+        superblock_set_flags(fs, sb->flags | SB_FLAG_COMPRESS);
+    }
+    
+    new_inode->proj_id = 5;  // Group ID
+    inode_crc_finalize_counted(new_inode);
+    
+    // Create its directory entry
+    int rc = dir_link(fs, dir, rf->slot, name, rf->inode, 1);
+    
+    // Fragmentation report: number of runs of consecutive blocks
+    res->blocks = fb->total;
+    res->extents = fb->total > 0 ? 1 : 0;
+    for (size_t j = 1; j < fb->total; j++) {
+        if (fb->bits[j] != fb->bits[j - 1] + 1) res->extents++;
+    }
+    res->raw_blocks = rf->blocks_needed;
+    res->stored_blocks = rf->stored_blocks;
+    res->shared = shared;
+    free(fb->bits);
+    free(fb->data);
+    memset(fb, 0, sizeof(*fb));
+    if (rc != 0) return -1;
+    
+    fs->added++;
+    return 0;
+}
+
+// Store a file's contents in new blocks and link it into "dir" as inode
+// index "free_inode" (from add_prepare). On failure the image is left as it
+// was before the call; the caller frees "data" either way.
+static int place_file(fs_t* fs, dir_t* dir, const char* name, long free_inode,
+                      file_data_t* data, add_result_t* res) {
+    size_t blocks_needed = (data->size + BS - 1) / BS;
+    if (journal_reserve(fs, journal_need(fs, dir, blocks_needed)) != 0) return -1;
+    
+    // With --compress, pack the file first unless a reader already has; it
+    // is stored compressed only if that takes fewer blocks
+    if (fs->compress && data->fd >= 0 && blocks_needed > 0) {
+        if (compress_file(data->fd, data->size, &data->packed) < 0) {
+            fprintf(stderr, "Error compressing file data\n");
+            return -1;
+        }
+    }
+    
+    reserved_file_t rf;
+    if (reserve_file(fs, dir, free_inode, data, &rf) != 0) return -1;
+    if (fill_file(fs, data, &rf) != 0) {
+        fprintf(stderr, "Error reading file data\n");
+        unreserve_file(fs, dir, &rf);
+        return -1;
+    }
+    return finish_file(fs, dir, name, data, &rf, res);
+}
+
+// The checks a host path must pass before anything is allocated for it;
+// its size goes to *size
+static int check_host_file(const char* path, size_t* size) {
+    // Check if file to add exists
+    struct stat file_stat;
+    if (stat(path, &file_stat) != 0) {
+        fprintf(stderr, "Error: file '%s' not found\n", path);
+        return -1;
+    }
+    
+    if (!S_ISREG(file_stat.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a regular file\n", path);
+        return -1;
+    }
+    
+    *size = file_stat.st_size;
+    return check_file_size(path, *size);
+}
+
+static void report_add(const fs_t* fs, const char* path, const add_result_t* res, uint64_t crc_bytes) {
+    printf("Successfully added '%s' to filesystem\n", path);
+    printf("  %zu block(s) in %zu extent(s)\n", res->blocks, res->extents);
+    if (res->stored_blocks < res->raw_blocks) {
+        printf("  compressed from %zu to %zu block(s)\n", res->raw_blocks, res->stored_blocks);
+    }
+    if (fs->dedup.on) {
+        printf("  %ld block(s) shared with existing data\n", res->shared);
+    }
+    if (fs->stats) {
+        printf("  %" PRIu64 " CRC byte(s) hashed\n", crc_bytes);
+    }
+}
+
+// Add one host file to the root directory, named by its path as given. On
+// failure the image is left as it was before the call.
+static int add_file(fs_t* fs, const char* add_file) {
+    uint64_t crc_start = crc_bytes_hashed;
+    
+    size_t file_size;
+    if (check_host_file(add_file, &file_size) != 0) return -1;
+    
+    long free_inode = add_prepare(fs, &fs->root, add_file);
+    if (free_inode < 0) return -1;
+    
+    file_data_t data = { .size = file_size, .fd = -1 };
+    if (file_size > 0 && (data.fd = open(add_file, O_RDONLY)) < 0) {
+        perror("open add_file");
+        return -1;
+    }
+    add_result_t res;
+    int rc = place_file(fs, &fs->root, add_file, free_inode, &data, &res);
+    if (data.fd >= 0) close(data.fd);
+    file_data_free(&data);
+    if (rc != 0) return -1;
+    
+    report_add(fs, add_file, &res, crc_bytes_hashed - crc_start);
+    return 0;
+}
+
+// --file and --manifest paths are added in groups of up to BATCH_FILES:
+//   1. worker threads compress the group's files (--compress only)
+//   2. serially and in path order, each file is checked and its inode,
+//      blocks and dirent slot are reserved, just as one-at-a-time adds
+//      allocate them
+//   3. worker threads fill the reserved blocks, a file at a time, with
+//      pread or copy_file_range
+//   4. serially again, each file's inode, dirent and CRCs are written
+// The image is thus byte-identical whatever the thread count, and to
+// adding the files one by one. A group also ends where the journal must
+// commit, so commits fall where they would one file at a time. --dedup
+// decides sharing from data already in place, so it adds one by one.
+#define BATCH_FILES 1024
+#define BATCH_BYTES (256u << 20)    // raw bytes compressed ahead with --compress
+
+typedef struct {
+    const char* path;
+    file_data_t data;
+    reserved_file_t rf;
+    int rc;                 // result of the last worker step
+} batch_file_t;
+
+typedef struct {
+    fs_t* fs;
+    batch_file_t* files;
+    size_t hi;              // workers take files up to here
+    atomic_size_t next;
+} batch_t;
+
+static void* batch_compress(void* arg) {
+    batch_t* b = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&b->next, 1)) < b->hi) {
+        batch_file_t* f = &b->files[i];
+        if (f->data.size == 0) continue;
+        int fd = open(f->path, O_RDONLY);
+        f->rc = fd < 0 || compress_file(fd, f->data.size, &f->data.packed) < 0 ? -1 : 0;
+        if (fd >= 0) close(fd);
+    }
+    return NULL;
+}
+
+static void* batch_fill(void* arg) {
+    batch_t* b = arg;
+    size_t i;
+    while ((i = atomic_fetch_add(&b->next, 1)) < b->hi) {
+        batch_file_t* f = &b->files[i];
+        file_data_t data = f->data;
+        if (!data.packed.buf && data.size > 0 && (data.fd = open(f->path, O_RDONLY)) < 0) {
+            f->rc = -1;
+            continue;
+        }
+        f->rc = fill_file(b->fs, &data, &f->rf);
+        if (data.fd >= 0) close(data.fd);
+    }
+    return NULL;
+}
+
+// Run a worker step over files [lo, hi) on "threads" threads, the caller's
+// included
+static void batch_run(batch_t* b, int threads, size_t lo, size_t hi, void* (*fn)(void*)) {
+    if (lo >= hi) return;
+    b->hi = hi;
+    atomic_store(&b->next, lo);
+    
+    pthread_t tid[threads];
+    int started = 0;
+    while (started + 1 < threads && (size_t)started + 1 < hi - lo &&
+           pthread_create(&tid[started], NULL, fn, b) == 0) {
+        started++;
+    }
+    fn(b);
+    for (int k = 0; k < started; k++) pthread_join(tid[k], NULL);
+}
+
+// Whether "name" is among the group's reserved files, whose dirents are not
+// written yet. seen[] holds file index + 1 per bucket.
+static int batch_seen(uint32_t* seen, const batch_file_t* files, const char* name, size_t add) {
+    size_t mask = 2 * BATCH_FILES - 1;
+    size_t b = name_hash(name) & mask;
+    for (; seen[b] != 0; b = (b + 1) & mask) {
+        if (strcmp(files[seen[b] - 1].path, name) == 0) return 1;
+    }
+    seen[b] = add + 1;
+    return 0;
+}
+
+// Add host files to the root directory, named by their paths as given.
+// Stops at the first failure, keeping the files before it.
+static int add_files(fs_t* fs, char** paths, size_t count, int threads) {
+    if (fs->dedup.on) {
+        for (size_t i = 0; i < count; i++) {
+            if (add_file(fs, paths[i]) != 0) return -1;
+        }
+        return 0;
+    }
+    
+    batch_file_t* files = calloc(count, sizeof(batch_file_t));
+    uint32_t* seen = malloc(2 * BATCH_FILES * sizeof(uint32_t));
+    if (!files || !seen) {
+        perror("calloc");
+        free(files);
+        free(seen);
+        return -1;
+    }
+    for (size_t i = 0; i < count; i++) {
+        files[i].path = paths[i];
+        files[i].data.fd = -1;
+    }
+    batch_t b = { .fs = fs, .files = files };
+    
+    // Files [done, ready) are checked (and compressed); "bad" failed its
+    // checks
+    size_t done = 0, ready = 0, bad = count;
+    int failed = 0;
+    while (!failed && done < count) {
+        if (done == bad) {
+            failed = 1;
+            break;
+        }
+        
+        size_t end = ready, bytes = 0;
+        for (size_t i = done; i < ready; i++) bytes += files[i].data.size;
+        while (end < bad && end - done < BATCH_FILES && (!fs->compress || bytes < BATCH_BYTES)) {
+            if (check_host_file(files[end].path, &files[end].data.size) != 0) {
+                bad = end;
+                break;
+            }
+            bytes += files[end++].data.size;
+        }
+        if (fs->compress) batch_run(&b, threads, ready, end, batch_compress);
+        ready = end;
+        
+        // Reserve in path order
+        memset(seen, 0, 2 * BATCH_FILES * sizeof(uint32_t));
+        size_t hi = done;
+        while (hi < ready) {
+            batch_file_t* f = &files[hi];
+            if (f->rc != 0) {
+                fprintf(stderr, "Error compressing file data\n");
+                failed = 1;
+                break;
+            }
+            long free_inode = add_prepare(fs, &fs->root, f->path);
+            if (free_inode >= 0 && batch_seen(seen, files, f->path, hi)) {
+                fprintf(stderr, "Error: file '%s' already exists in filesystem\n", f->path);
+                free_inode = -1;
+            }
+            if (free_inode < 0) {
+                failed = 1;
+                break;
+            }
+            
+            size_t need = journal_need(fs, &fs->root, (f->data.size + BS - 1) / BS);
+            if (journal_full(fs, need)) {
+                if (hi > done) break;
+                if (fs_commit(fs) != 0) {
+                    failed = 1;
+                    break;
+                }
+            }
+            if (reserve_file(fs, &fs->root, free_inode, &f->data, &f->rf) != 0) {
+                failed = 1;
+                break;
+            }
+            hi++;
+        }
+        
+        batch_run(&b, threads, done, hi, batch_fill);
+        
+        // Link in path order; on a failed fill, give back that file's and
+        // every later reservation, newest first
+        for (size_t i = done; i < hi; i++) {
+            batch_file_t* f = &files[i];
+            uint64_t crc_start = crc_bytes_hashed;
+            add_result_t res;
+            if (f->rc != 0) {
+                fprintf(stderr, "Error reading file data\n");
+                for (size_t j = hi; j-- > i;) unreserve_file(fs, &fs->root, &files[j].rf);
+                failed = 1;
+                break;
+            }
+            if (finish_file(fs, &fs->root, f->path, &f->data, &f->rf, &res) != 0) {
+                for (size_t j = hi; --j > i;) unreserve_file(fs, &fs->root, &files[j].rf);
+                failed = 1;
+                break;
+            }
+            report_add(fs, f->path, &res, crc_bytes_hashed - crc_start);
+            file_data_free(&f->data);
+        }
+        done = hi;
+    }
+    
+    for (size_t i = 0; i < count; i++) file_data_free(&files[i].data);
+    free(files);
+    free(seen);
+    return failed ? -1 : 0;
+}
+
+// Create an empty subdirectory "name" in "dir": a new inode whose one block
+// holds "." and "..". Returns its inode number, or 0 with the image left as
+// it was.
+static uint32_t add_dir(fs_t* fs, dir_t* dir, const char* name) {
+    superblock_t* sb = fs->sb;
+    long free_inode = add_prepare(fs, dir, name);
+    if (free_inode < 0) return 0;
+    
+    // The inode bitmap and table blocks, both directory blocks, the data
+    // bitmap block and the parent's inode block
+    if (journal_reserve(fs, 6) != 0) return 0;
+    
+    long bit = free_map_alloc(&fs->free_map, 1, 0);
+    if (bit < 0 || (dir->index.free_count == 0 && dir_grow(fs, dir) != 0)) {
+        if (bit >= 0) free_map_release(&fs->free_map, bit);
+        fprintf(stderr, "Error: no free data blocks for directory\n");
+        return 0;
+    }
+    
+    uint32_t block = sb->data_region_start + bit;
+    uint8_t* dir_block = block_ptr(fs->img.base, block);
+    memset(dir_block, 0, BS);
+    dir_block_track(fs, block);
+    
+    dirent64_t* dot_entry = (dirent64_t*)dir_block;
+    dot_entry->inode_no = free_inode + 1;
+    dot_entry->type = 2;
+    strcpy(dot_entry->name, ".");
+    dirent64_t* dotdot_entry = dot_entry + 1;
+    dotdot_entry->inode_no = dir->ino;
+    dotdot_entry->type = 2;
+    strcpy(dotdot_entry->name, "..");
+    dirent_checksum_finalize(dot_entry);
+    dirent_checksum_finalize(dotdot_entry);
+    
+    inode_t* new_inode = &fs->inode_table[free_inode];
+    memset(new_inode, 0, sizeof(inode_t));
+    new_inode->mode = 0040000;  // Directory
+    new_inode->links = 2;       // its entry in "dir" and its own "."
+    new_inode->size_bytes = 2 * sizeof(dirent64_t);
+    new_inode->atime = fs->now;
+    new_inode->mtime = fs->now;
+    new_inode->ctime = fs->now;
+    new_inode->direct[0] = block;
+    new_inode->proj_id = 5;  // Group ID
+    inode_crc_finalize_counted(new_inode);
+    
+    // The new ".." is one more link to the parent
+    bitmap_set(&fs->inodes, free_inode);
+    dir->inode->links++;
+    int rc = dir_link(fs, dir, dir_take_slot(dir), name, free_inode, 2);
+    
+    rc |= mark_dirty(&fs->img, block);
+    rc |= mark_dirty(&fs->img, bitmap_block_of(sb->data_bitmap_start, bit));
+    rc |= mark_dirty(&fs->img, bitmap_block_of(sb->inode_bitmap_start, free_inode));
+    rc |= mark_dirty(&fs->img, inode_table_block(sb, (uint32_t)free_inode + 1));
+    if (rc != 0) return 0;
+    
+    fs->added++;
+    return free_inode + 1;
+}
+
+// Paths gathered from consecutive --file and --manifest sources
 typedef struct {
-    uint32_t magic;                 // 0x4D565346
-    uint32_t version;               // 1
-    uint32_t block_size;            // 4096
-    uint64_t total_blocks;          // size_kib * 1024 / 4096
-    uint64_t inode_count;           // number of inodes
-    uint64_t inode_bitmap_start;    // block number where inode bitmap starts
-    uint64_t inode_bitmap_blocks;   // number of blocks for inode bitmap
-    uint64_t data_bitmap_start;     // block number where data bitmap starts
-    uint64_t data_bitmap_blocks;    // number of blocks for data bitmap
-    uint64_t inode_table_start;     // block number where inode table starts
-    uint64_t inode_table_blocks;    // number of blocks for inode table
-    uint64_t data_region_start;     // block number where data region starts
-    uint64_t data_region_blocks;    // number of blocks for data region
-    uint64_t root_inode;            // 1
-    uint64_t mtime_epoch;           // build time
-    uint32_t flags;                 // 0
-    uint32_t checksum;              // crc32(superblock[0..4091])
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
+    char** paths;
+    size_t count;
+    size_t cap;
+} path_list_t;
+
+static int path_list_push(path_list_t* l, const char* path) {
+    if (l->count == l->cap) {
+        size_t cap = l->cap ? l->cap * 2 : 64;
+        char** paths = realloc(l->paths, cap * sizeof(char*));
+        if (!paths) {
+            perror("realloc");
+            return -1;
+        }
+        l->paths = paths;
+        l->cap = cap;
+    }
+    if ((l->paths[l->count] = strdup(path)) == NULL) {
+        perror("strdup");
+        return -1;
+    }
+    l->count++;
+    return 0;
+}
+
+static void path_list_free(path_list_t* l) {
+    for (size_t i = 0; i < l->count; i++) free(l->paths[i]);
+    free(l->paths);
+    memset(l, 0, sizeof(*l));
+}
+
+// Append every path listed in a manifest, one per line ("-" reads stdin)
+static int read_manifest(path_list_t* l, const char* manifest) {
+    FILE* fp = strcmp(manifest, "-") == 0 ? stdin : fopen(manifest, "r");
+    if (!fp) {
+        perror("fopen manifest");
+        return -1;
+    }
+    
+    char line[4096];
+    int rc = 0;
+    while (rc == 0 && fgets(line, sizeof(line), fp)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0') continue;
+        rc = path_list_push(l, line);
+    }
+    
+    if (fp != stdin) fclose(fp);
+    return rc;
+}
+
+// --tree import. The host tree is walked up front into nodes in breadth-
+// first order, each directory's children contiguous and sorted by name, so
+// the writer fills one directory at a time and the image does not depend on
+// readdir order. Reader threads load files into memory ahead of the writer,
+// which alone allocates blocks and links entries, in node order.
+#define TREE_PREFETCH_MAX (4u << 20)    // larger files are read by the writer
+#define TREE_WINDOW_BYTES (64u << 20)   // loaded but not yet written
+
+typedef enum {
+    NODE_PENDING,
+    NODE_LOADED,
+    NODE_FAILED,
+} node_state_t;
+
 typedef struct {
-    uint16_t mode;          // file type: 0100000 (octal) for files, 0040000 (octal) for dirs
-    uint16_t links;         // number of directories pointing to this inode
-    uint32_t uid;           // user id (0)
-    uint32_t gid;           // group id (0)
-    uint64_t size_bytes;    // size in bytes
-    uint64_t atime;         // access time
-    uint64_t mtime;         // modify time
-    uint64_t ctime;         // create time
-    uint32_t direct[12];    // direct block pointers
-    uint32_t reserved_0;    // 0
-    uint32_t reserved_1;    // 0
-    uint32_t reserved_2;    // 0
-    uint32_t proj_id;       // your group ID
-    uint32_t uid16_gid16;   // 0
-    uint64_t xattr_ptr;     // 0
-    uint64_t inode_crc;     // checksum
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
+    char* path;             // host path
+    const char* name;       // last component of path
+    size_t parent;          // index of the containing directory's node
+    int is_dir;
+    size_t size;
+    uint32_t ino;           // inode number, once a directory is created
+    node_state_t state;     // set by the reader that loads the file
+    file_data_t data;
+} tree_node_t;
+
 typedef struct {
-    uint32_t inode_no;      // inode number (0 if free)
-    uint8_t  type;          // 1=file, 2=dir
-    char     name[58];      // filename
-    uint8_t  checksum;      // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
-    }
-}
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-// ====================================CRC32====================================
-
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
-
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c;
-}
-
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];
-    de->checksum = x;
-}
-
-// Helper function to find first free bit in bitmap
-static int find_free_bit(uint8_t* bitmap, size_t bitmap_size_bits) {
-    for (size_t byte = 0; byte < (bitmap_size_bits + 7) / 8; byte++) {
-        if (bitmap[byte] != 0xFF) {
-            for (int bit = 0; bit < 8; bit++) {
-                if (!(bitmap[byte] & (1 << bit))) {
-                    size_t bit_pos = byte * 8 + bit;
-                    if (bit_pos < bitmap_size_bits) {
-                        return bit_pos;
-                    }
+    tree_node_t* nodes;     // nodes[0] is the tree's top, merged into the root
+    size_t count;
+    size_t cap;
+    int compress;
+    int readers;            // reader threads running
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    size_t next;            // next node a reader considers
+    size_t writer_at;       // node the writer is waiting for
+    size_t window;          // bytes being loaded or loaded, not yet written
+    int stop;
+} tree_t;
+
+// Files a reader loads; empty and large ones are left to the writer
+static int tree_prefetched(const tree_node_t* n) {
+    return !n->is_dir && n->size > 0 && n->size <= TREE_PREFETCH_MAX;
+}
+
+// Append a node for "path" (taken over), or skip it with a warning if it is
+// neither a regular file nor a directory
+static int tree_push(tree_t* t, char* path, size_t name_off, size_t parent) {
+    struct stat st;
+    if (lstat(path, &st) != 0) {
+        fprintf(stderr, "Error: cannot stat '%s': %s\n", path, strerror(errno));
+        free(path);
+        return -1;
+    }
+    if (!S_ISREG(st.st_mode) && !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Warning: skipping '%s' (not a regular file or directory)\n", path);
+        free(path);
+        return 0;
+    }
+    if (strlen(path + name_off) > 57) {
+        fprintf(stderr, "Error: filename '%s' too long (max 57 characters)\n", path + name_off);
+        free(path);
+        return -1;
+    }
+    if (S_ISREG(st.st_mode) && check_file_size(path, st.st_size) != 0) {
+        free(path);
+        return -1;
+    }
+    
+    if (t->count == t->cap) {
+        size_t cap = t->cap ? t->cap * 2 : 256;
+        tree_node_t* nodes = realloc(t->nodes, cap * sizeof(tree_node_t));
+        if (!nodes) {
+            perror("realloc");
+            free(path);
+            return -1;
+        }
+        t->nodes = nodes;
+        t->cap = cap;
+    }
+    tree_node_t* n = &t->nodes[t->count++];
+    memset(n, 0, sizeof(*n));
+    n->path = path;
+    n->name = path + name_off;
+    n->parent = parent;
+    n->is_dir = S_ISDIR(st.st_mode);
+    n->size = n->is_dir ? 0 : (size_t)st.st_size;
+    n->data.fd = -1;
+    return 0;
+}
+
+static int cmp_str(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Walk the host tree under "top" into t->nodes
+static int tree_walk(tree_t* t, const char* top) {
+    struct stat st;
+    if (stat(top, &st) != 0 || !S_ISDIR(st.st_mode)) {
+        fprintf(stderr, "Error: '%s' is not a directory\n", top);
+        return -1;
+    }
+    char* top_path = strdup(top);
+    if (!top_path || tree_push(t, top_path, strlen(top), 0) != 0) return -1;
+    
+    for (size_t i = 0; i < t->count; i++) {
+        if (!t->nodes[i].is_dir) continue;
+        const char* dir_path = t->nodes[i].path;
+        DIR* d = opendir(dir_path);
+        if (!d) {
+            fprintf(stderr, "Error: cannot open directory '%s': %s\n", dir_path, strerror(errno));
+            return -1;
+        }
+        
+        char** names = NULL;
+        size_t count = 0, cap = 0;
+        int rc = 0;
+        struct dirent* de;
+        while (rc == 0 && (de = readdir(d)) != NULL) {
+            if (strcmp(de->d_name, ".") == 0 || strcmp(de->d_name, "..") == 0) continue;
+            if (count == cap) {
+                cap = cap ? cap * 2 : 64;
+                char** grown = realloc(names, cap * sizeof(char*));
+                if (!grown) {
+                    perror("realloc");
+                    rc = -1;
+                    break;
                 }
+                names = grown;
+            }
+            if ((names[count] = strdup(de->d_name)) == NULL) {
+                perror("strdup");
+                rc = -1;
+                break;
+            }
+            count++;
+        }
+        closedir(d);
+        
+        qsort(names, count, sizeof(char*), cmp_str);
+        size_t dir_len = strlen(dir_path);
+        for (size_t k = 0; k < count; k++) {
+            char* path = rc == 0 ? malloc(dir_len + strlen(names[k]) + 2) : NULL;
+            if (path) {
+                sprintf(path, "%s/%s", t->nodes[i].path, names[k]);
+                rc = tree_push(t, path, dir_len + 1, i);
+            } else if (rc == 0) {
+                perror("malloc");
+                rc = -1;
+            }
+            free(names[k]);
+        }
+        free(names);
+        if (rc != 0) return -1;
+    }
+    return 0;
+}
+
+// Read a whole file into n->data: packed if --compress pays off, raw
+// otherwise
+static int tree_load(tree_node_t* n, int compress) {
+    int fd = open(n->path, O_RDONLY);
+    if (fd < 0) return -1;
+    
+    int packed = compress ? compress_file(fd, n->size, &n->data.packed) : 0;
+    int rc = packed < 0 ? -1 : 0;
+    if (packed == 0) {
+        n->data.raw = calloc((n->size + BS - 1) / BS, BS);
+        if (!n->data.raw) rc = -1;
+        size_t done = 0;
+        while (rc == 0 && done < n->size) {
+            ssize_t got = pread(fd, n->data.raw + done, n->size - done, done);
+            if (got < 0 && errno == EINTR) continue;
+            if (got <= 0) rc = -1;
+            else done += got;
+        }
+    }
+    close(fd);
+    n->data.size = n->size;
+    return rc;
+}
+
+// Reader thread: claim files in node order and load them, keeping at most
+// TREE_WINDOW_BYTES ahead of the writer. The file the writer waits on is
+// always admitted, so a large file cannot stall the pipeline.
+static void* tree_reader(void* arg) {
+    tree_t* t = arg;
+    pthread_mutex_lock(&t->lock);
+    while (!t->stop) {
+        while (t->next < t->count && !tree_prefetched(&t->nodes[t->next])) t->next++;
+        if (t->next == t->count) break;
+        size_t i = t->next++;
+        tree_node_t* n = &t->nodes[i];
+        
+        while (!t->stop && i != t->writer_at && t->window + n->size > TREE_WINDOW_BYTES) {
+            pthread_cond_wait(&t->cond, &t->lock);
+        }
+        if (t->stop) break;
+        t->window += n->size;
+        pthread_mutex_unlock(&t->lock);
+        
+        int rc = tree_load(n, t->compress);
+        
+        pthread_mutex_lock(&t->lock);
+        n->state = rc == 0 ? NODE_LOADED : NODE_FAILED;
+        pthread_cond_broadcast(&t->cond);
+    }
+    pthread_mutex_unlock(&t->lock);
+    return NULL;
+}
+
+// Add file node "i" to "dir": from the copy a reader loaded, or read here
+static int tree_add_file(fs_t* fs, tree_t* t, size_t i, dir_t* dir, add_result_t* res) {
+    tree_node_t* n = &t->nodes[i];
+    long free_inode = add_prepare(fs, dir, n->name);
+    if (free_inode < 0) return -1;
+    
+    if (t->readers > 0 && tree_prefetched(n)) {
+        pthread_mutex_lock(&t->lock);
+        t->writer_at = i;
+        pthread_cond_broadcast(&t->cond);
+        while (n->state == NODE_PENDING) pthread_cond_wait(&t->cond, &t->lock);
+        pthread_mutex_unlock(&t->lock);
+        
+        int rc = -1;
+        if (n->state == NODE_FAILED) {
+            fprintf(stderr, "Error reading '%s'\n", n->path);
+        } else {
+            rc = place_file(fs, dir, n->name, free_inode, &n->data, res);
+        }
+        file_data_free(&n->data);
+        
+        pthread_mutex_lock(&t->lock);
+        t->window -= n->size;
+        pthread_cond_broadcast(&t->cond);
+        pthread_mutex_unlock(&t->lock);
+        return rc;
+    }
+    
+    file_data_t data = { .size = n->size, .fd = -1 };
+    if (n->size > 0 && (data.fd = open(n->path, O_RDONLY)) < 0) {
+        fprintf(stderr, "Error: cannot open '%s': %s\n", n->path, strerror(errno));
+        return -1;
+    }
+    int rc = place_file(fs, dir, n->name, free_inode, &data, res);
+    if (data.fd >= 0) close(data.fd);
+    file_data_free(&data);
+    return rc;
+}
+
+// Stop using a --tree subdirectory: finalize its inode and drop its index
+static int tree_close_dir(fs_t* fs) {
+    if (!fs->subdir) return 0;
+    int rc = dir_finalize(fs, fs->subdir);
+    dir_index_free(&fs->subdir->index);
+    fs->subdir = NULL;
+    return rc;
+}
+
+// Import the host directory "top": its entries go into the root directory,
+// subdirectories become directory inodes. Stops at the first failure, with
+// everything added before it kept.
+static int add_tree(fs_t* fs, const char* top, int threads) {
+    tree_t t = { .compress = fs->compress, .writer_at = (size_t)-1 };
+    pthread_mutex_init(&t.lock, NULL);
+    pthread_cond_init(&t.cond, NULL);
+    int rc = tree_walk(&t, top);
+    
+    pthread_t tid[threads];
+    for (int k = 0; rc == 0 && k < threads; k++) {
+        if (pthread_create(&tid[k], NULL, tree_reader, &t) != 0) {
+            perror("pthread_create");
+            break;
+        }
+        t.readers++;
+    }
+    
+    // Children are grouped by parent, so a directory is complete once the
+    // writer moves past its children
+    dir_t sub;
+    dir_t* dir = &fs->root;
+    size_t dir_node = 0;
+    size_t files = 0, dirs = 0;
+    add_result_t sum = { 0 };
+    if (rc == 0) t.nodes[0].ino = ROOT_INO;
+    for (size_t i = 1; rc == 0 && i < t.count; i++) {
+        tree_node_t* n = &t.nodes[i];
+        if (n->parent != dir_node) {
+            rc = tree_close_dir(fs);
+            if (rc != 0 || (rc = dir_open(fs, &sub, t.nodes[n->parent].ino)) != 0) {
+                dir_index_free(&sub.index);
+                break;
             }
+            fs->subdir = dir = &sub;
+            dir_node = n->parent;
+        }
+        
+        if (n->is_dir) {
+            n->ino = add_dir(fs, dir, n->name);
+            rc = n->ino != 0 ? 0 : -1;
+            dirs += n->ino != 0;
+            continue;
+        }
+        
+        add_result_t res;
+        rc = tree_add_file(fs, &t, i, dir, &res);
+        if (rc == 0) {
+            files++;
+            sum.blocks += res.blocks;
+            sum.extents += res.extents;
+            sum.raw_blocks += res.raw_blocks;
+            sum.stored_blocks += res.stored_blocks;
+            sum.shared += res.shared;
+        }
+    }
+    if (tree_close_dir(fs) != 0) rc = -1;
+    
+    pthread_mutex_lock(&t.lock);
+    t.stop = 1;
+    pthread_cond_broadcast(&t.cond);
+    pthread_mutex_unlock(&t.lock);
+    for (int k = 0; k < t.readers; k++) pthread_join(tid[k], NULL);
+    for (size_t i = 0; i < t.count; i++) {
+        free(t.nodes[i].path);
+        file_data_free(&t.nodes[i].data);
+    }
+    free(t.nodes);
+    pthread_mutex_destroy(&t.lock);
+    pthread_cond_destroy(&t.cond);
+    if (rc != 0) return -1;
+    
+    printf("Successfully added tree '%s' to filesystem\n", top);
+    printf("  %zu file(s), %zu directory(ies)\n", files, dirs);
+    printf("  %zu block(s) in %zu extent(s)\n", sum.blocks, sum.extents);
+    if (sum.stored_blocks < sum.raw_blocks) {
+        printf("  compressed from %zu to %zu block(s)\n", sum.raw_blocks, sum.stored_blocks);
+    }
+    if (fs->dedup.on) {
+        printf("  %ld block(s) shared with existing data\n", sum.shared);
+    }
+    return 0;
+}
+
+// Find "path" as mvfs_lookup() does: a name in the root directory, else
+// "dir/.../name" through subdirectories. Returns its dirent slot in *dir,
+// which is the root or "sub" (opened here, freed by the caller); -1 if it
+// does not exist, -2 when out of memory.
+static long remove_lookup(fs_t* fs, const char* path, dir_t* sub, dir_t** dir) {
+    *dir = &fs->root;
+    long slot = dir_lookup(fs, &fs->root, path);
+    if (slot >= 0) return slot;
+    
+    while (*path == '/') path++;
+    while (*path) {
+        char name[sizeof(((dirent64_t*)0)->name)];
+        size_t len = strcspn(path, "/");
+        if (len >= sizeof(name)) return -1;
+        memcpy(name, path, len);
+        name[len] = '\0';
+        path += len;
+        while (*path == '/') path++;
+        
+        slot = dir_lookup(fs, *dir, name);
+        if (slot < 0 || *path == '\0') return slot;
+        uint32_t ino = dir_slot(fs, *dir, slot)->inode_no;
+        if (ino == 0 || ino > fs->sb->inode_count || fs->inode_table[ino - 1].mode != 0040000) return -1;
+        
+        // Its blocks now take part in the journal like the root's
+        dir_index_free(&sub->index);
+        if (dir_open(fs, sub, ino) != 0) return -2;
+        for (int k = 0; k < DIRECT_MAX; k++) {
+            uint32_t block = sub->inode->direct[k];
+            if (block >= fs->sb->data_region_start && block < fs->sb->total_blocks) dir_block_track(fs, block);
         }
+        *dir = sub;
     }
     return -1;
 }
 
-// Helper function to set a bit in bitmap
-static void set_bit(uint8_t* bitmap, int bit_pos) {
-    bitmap[bit_pos / 8] |= (1 << (bit_pos % 8));
+// Whether "block" is an allocated block of the data region
+static int data_block_used(const fs_t* fs, uint32_t block) {
+    const superblock_t* sb = fs->sb;
+    return block >= sb->data_region_start && block - sb->data_region_start < sb->data_region_blocks &&
+           bitmap_test(&fs->blocks, block - sb->data_region_start);
 }
 
-int main(int argc, char** argv) {
-    crc32_init();
+// Number of data bitmap blocks the sorted bits bits[0 .. count-1] fall in
+static size_t bitmap_blocks_spanned(const uint64_t* bits, size_t count) {
+    size_t n = 0;
+    for (size_t i = 0; i < count; i++) {
+        n += i == 0 || bits[i] / BITS_PER_BITMAP_BLOCK != bits[i - 1] / BITS_PER_BITMAP_BLOCK;
+    }
+    return n;
+}
+
+// Drop the dedup references a removed file held. Returns how many of its
+// blocks are still used by other files; those are taken out of bits[0 ..
+// *count-1].
+static size_t dedup_unref(fs_t* fs, uint64_t* bits, size_t* count) {
+    size_t kept = 0, shared = 0;
+    for (size_t i = 0; i < *count; i++) {
+        uint32_t* refs = &fs->dedup.refs[bits[i]];
+        if (*refs > 1) {
+            (*refs)--;
+            shared++;
+        } else {
+            *refs = 0;
+            bits[kept++] = bits[i];
+        }
+    }
+    *count = kept;
+    return shared;
+}
+
+// Remove "path": a regular file, or an empty directory made by --tree. Its
+// dirent is cleared, its inode freed, and so are its data and pointer blocks
+// unless another file still shares them. On a journaled image the blocks are
+// reused only once the remove is committed, so a crash can never leave the
+// old file pointing at new data. Fails without changing the image unless out
+// of memory.
+static int remove_path(fs_t* fs, const char* path) {
+    superblock_t* sb = fs->sb;
+    dir_t sub = { 0 };
+    dir_t* dir;
+    long slot = remove_lookup(fs, path, &sub, &dir);
+    if (slot < 0) {
+        if (slot == -1) fprintf(stderr, "Error: '%s' not found in filesystem\n", path);
+        dir_index_free(&sub.index);
+        return -1;
+    }
     
-    // Parse CLI parameters
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s --input <file> --output <file> --file <file>\n", argv[0]);
-        return 1;
+    dirent64_t* de = dir_slot(fs, dir, slot);
+    uint32_t ino = de->inode_no;
+    if (strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0 || ino <= ROOT_INO ||
+        ino > sb->inode_count || !bitmap_test(&fs->inodes, ino - 1)) {
+        fprintf(stderr, "Error: cannot remove '%s'\n", path);
+        dir_index_free(&sub.index);
+        return -1;
     }
+    inode_t* inode = &fs->inode_table[ino - 1];
+    int is_dir = inode->mode == 0040000;
     
-    const char* input_file = NULL;
-    const char* output_file = NULL;
-    const char* add_file = NULL;
+    // A directory must hold nothing but "." and ".."
+    for (int k = 0; is_dir && k < DIRECT_MAX; k++) {
+        if (!data_block_used(fs, inode->direct[k])) continue;
+        const dirent64_t* e = (const dirent64_t*)block_ptr(fs->img.base, inode->direct[k]);
+        for (size_t j = 0; j < DIRENTS_PER_BLOCK; j++) {
+            if (e[j].inode_no != 0 && strcmp(e[j].name, ".") != 0 && strcmp(e[j].name, "..") != 0) {
+                fprintf(stderr, "Error: directory '%s' is not empty\n", path);
+                dir_index_free(&sub.index);
+                return -1;
+            }
+        }
+    }
     
-    for (int i = 1; i < argc; i += 2) {
-        if (strcmp(argv[i], "--input") == 0) {
-            input_file = argv[i + 1];
-        } else if (strcmp(argv[i], "--output") == 0) {
-            output_file = argv[i + 1];
-        } else if (strcmp(argv[i], "--file") == 0) {
-            add_file = argv[i + 1];
+    // Its blocks as data bitmap bits: data blocks first, then the pointer
+    // blocks mapping them, each part sorted
+    uint64_t n = is_dir ? DIRECT_MAX : inode_data_blocks(fs, inode);
+    const uint64_t n_max = DIRECT_MAX + PTRS_PER_BLOCK * (PTRS_PER_BLOCK + 1);
+    if (n > n_max) n = n_max;
+    uint64_t* bits = malloc((n + map_blocks_for(n) + 2) * sizeof(uint64_t));
+    if (!bits) {
+        perror("malloc");
+        dir_index_free(&sub.index);
+        return -1;
+    }
+    size_t data_count = 0;
+    for (uint64_t i = 0; i < n; i++) {
+        uint32_t block = is_dir ? inode->direct[i] : inode_block(fs, inode, i);
+        if (data_block_used(fs, block)) bits[data_count++] = block - sb->data_region_start;
+    }
+    size_t count = data_count;
+    if (!is_dir && data_block_used(fs, inode->indirect)) {
+        bits[count++] = inode->indirect - sb->data_region_start;
+    }
+    if (!is_dir && data_block_used(fs, inode->double_indirect)) {
+        bits[count++] = inode->double_indirect - sb->data_region_start;
+        const uint32_t* dind = (const uint32_t*)block_ptr(fs->img.base, inode->double_indirect);
+        uint64_t l2 = n > DIRECT_MAX + PTRS_PER_BLOCK ?
+                      (n - DIRECT_MAX - 1) / PTRS_PER_BLOCK : 0;
+        for (uint64_t j = 0; j < l2; j++) {
+            if (data_block_used(fs, dind[j])) bits[count++] = dind[j] - sb->data_region_start;
+        }
+    }
+    qsort(bits, data_count, sizeof(uint64_t), cmp_u64);
+    qsort(bits + data_count, count - data_count, sizeof(uint64_t), cmp_u64);
+    
+    // Blocks of an image with shared data are freed with their last reference
+    int rc = 0;
+    if ((sb->flags & SB_FLAG_DEDUP) && !fs->dedup.refs && dedup_build(fs) != 0) {
+        dedup_free(&fs->dedup);
+        rc = -1;
+    }
+    if (rc == 0 && fs->img.journaled && fs->deferred_count + count > fs->deferred_cap) {
+        size_t cap = fs->deferred_cap * 2 > fs->deferred_count + count ? fs->deferred_cap * 2
+                                                                        : fs->deferred_count + count;
+        uint32_t* d = realloc(fs->deferred, cap * sizeof(uint32_t));
+        if (d) {
+            fs->deferred = d;
+            fs->deferred_cap = cap;
         } else {
-            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
-            return 1;
+            perror("realloc");
+            rc = -1;
         }
     }
     
-    if (!input_file || !output_file || !add_file) {
-        fprintf(stderr, "All arguments are required\n");
-        return 1;
+    // The inode bitmap and table blocks, the dirent block, the data bitmap
+    // blocks of the freed blocks and a subdirectory's inode block
+    size_t span = bitmap_blocks_spanned(bits, data_count) +
+                  bitmap_blocks_spanned(bits + data_count, count - data_count);
+    if (span > sb->data_bitmap_blocks) span = sb->data_bitmap_blocks;
+    if (rc != 0 || journal_reserve(fs, 3 + span + (dir != &fs->root)) != 0 ||
+        dir_unlink(fs, dir, slot) != 0) {
+        free(bits);
+        dir_index_free(&sub.index);
+        return -1;
     }
     
-    // Check if file to add exists
-    struct stat file_stat;
-    if (stat(add_file, &file_stat) != 0) {
-        fprintf(stderr, "Error: file '%s' not found\n", add_file);
-        return 1;
+    size_t shared = 0;
+    if (fs->dedup.refs && !is_dir) {
+        size_t kept = data_count;
+        shared = dedup_unref(fs, bits, &kept);
+        memmove(bits + kept, bits + data_count, (count - data_count) * sizeof(uint64_t));
+        count -= data_count - kept;
     }
     
-    if (!S_ISREG(file_stat.st_mode)) {
-        fprintf(stderr, "Error: '%s' is not a regular file\n", add_file);
-        return 1;
+    // A block listed twice is freed once
+    qsort(bits, count, sizeof(uint64_t), cmp_u64);
+    size_t freed = 0;
+    for (size_t i = 0; i < count; i++) {
+        if (i > 0 && bits[i] == bits[i - 1]) continue;
+        if (fs->img.journaled) {
+            fs->deferred[fs->deferred_count++] = bits[i];
+        } else {
+            free_map_release(&fs->free_map, bits[i]);
+        }
+        if (is_dir) bitmap_clear(&fs->dir_blocks, bits[i]);
+        rc |= mark_dirty(&fs->img, bitmap_block_of(sb->data_bitmap_start, bits[i]));
+        freed++;
     }
+    free(bits);
     
-    size_t file_size = file_stat.st_size;
+    // Its ".." no longer links the parent
+    if (is_dir) dir->inode->links--;
+    memset(inode, 0, sizeof(inode_t));
+    bitmap_clear(&fs->inodes, ino - 1);
+    rc |= mark_dirty(&fs->img, bitmap_block_of(sb->inode_bitmap_start, ino - 1));
+    rc |= mark_dirty(&fs->img, inode_table_block(sb, ino));
+    if (dir == &sub) rc |= dir_finalize(fs, &sub);
+    dir_index_free(&sub.index);
+    if (rc != 0) return -1;
     
-    // Check filename length (must fit in 58 characters including null terminator)
-    if (strlen(add_file) > 57) {
-        fprintf(stderr, "Error: filename too long (max 57 characters)\n");
+    fs->removed++;
+    printf("Successfully removed '%s' from filesystem\n", path);
+    printf("  %zu block(s) freed\n", freed);
+    if (shared > 0) printf("  %zu block(s) still shared with other files\n", shared);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* usage = "Usage: %s --input <file> (--output <file> | --in-place)\n"
+                        "          [--file <file> ...] [--manifest <list|->] [--tree <dir>]\n"
+                        "          [--remove <name> ...]\n"
+                        "          [--alloc scatter|first-fit|best-fit] [--no-zero-copy]\n"
+                        "          [--dedup] [--compress] [--threads <n>] [--epoch <seconds>]\n"
+                        "          [--stats]\n";
+    
+    const char* input_file = NULL;
+    const char* output_file = NULL;
+    int in_place = 0;
+    alloc_policy_t policy = ALLOC_FIRST_FIT;
+    int zero_copy = 1;
+    int stats = 0;
+    int dedup = 0;
+    int compress = 0;
+    long threads = sysconf(_SC_NPROCESSORS_ONLN);
+    const char* epoch_arg = NULL;
+    
+    // Files to add, in command-line order: "--file" paths, "--manifest" lists
+    // and "--tree" directories, and names to "--remove"
+    enum { SOURCE_FILE, SOURCE_MANIFEST, SOURCE_TREE, SOURCE_REMOVE };
+    const char** sources = calloc(argc, sizeof(char*));
+    int* source_kind = calloc(argc, sizeof(int));
+    int source_count = 0;
+    if (!sources || !source_kind) {
+        perror("calloc");
         return 1;
     }
     
-    // Check if file is too large (12 direct blocks max)
-    size_t max_file_size = 12 * BS;
-    if (file_size > max_file_size) {
-        fprintf(stderr, "Error: file too large (max %zu bytes)\n", max_file_size);
-        return 1;
+    // Parse CLI parameters
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--in-place") == 0) {
+            in_place = 1;
+        } else if (strcmp(argv[i], "--no-zero-copy") == 0) {
+            zero_copy = 0;
+        } else if (strcmp(argv[i], "--stats") == 0) {
+            stats = 1;
+        } else if (strcmp(argv[i], "--dedup") == 0) {
+            dedup = 1;
+        } else if (strcmp(argv[i], "--compress") == 0) {
+            compress = 1;
+        } else if (i + 1 >= argc) {
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        } else if (strcmp(argv[i], "--input") == 0) {
+            input_file = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0) {
+            output_file = argv[++i];
+        } else if (strcmp(argv[i], "--file") == 0) {
+            sources[source_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--alloc") == 0) {
+            const char* name = argv[++i];
+            if (strcmp(name, "scatter") == 0) {
+                policy = ALLOC_SCATTER;
+            } else if (strcmp(name, "first-fit") == 0) {
+                policy = ALLOC_FIRST_FIT;
+            } else if (strcmp(name, "best-fit") == 0) {
+                policy = ALLOC_BEST_FIT;
+            } else {
+                fprintf(stderr, "Error: unknown allocation policy '%s'\n", name);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--manifest") == 0) {
+            source_kind[source_count] = SOURCE_MANIFEST;
+            sources[source_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--tree") == 0) {
+            source_kind[source_count] = SOURCE_TREE;
+            sources[source_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--remove") == 0) {
+            source_kind[source_count] = SOURCE_REMOVE;
+            sources[source_count++] = argv[++i];
+        } else if (strcmp(argv[i], "--threads") == 0) {
+            threads = strtol(argv[++i], NULL, 10);
+        } else if (strcmp(argv[i], "--epoch") == 0) {
+            epoch_arg = argv[++i];
+        } else {
+            fprintf(stderr, "Unknown argument: %s\n", argv[i]);
+            return 1;
+        }
     }
     
-    // Read input filesystem image
-    FILE* input_fp = fopen(input_file, "rb");
-    if (!input_fp) {
-        perror("fopen input");
+    if (!input_file || source_count == 0 || (!output_file && !in_place)) {
+        fprintf(stderr, "All arguments are required\n");
+        fprintf(stderr, usage, argv[0]);
         return 1;
     }
     
-    // Get file size
-    fseek(input_fp, 0, SEEK_END);
-    size_t image_size = ftell(input_fp);
-    fseek(input_fp, 0, SEEK_SET);
+    if (in_place && output_file) {
+        fprintf(stderr, "Error: --output cannot be combined with --in-place\n");
+        return 1;
+    }
+    if (threads < 1) threads = 1;
+    if (threads > 256) threads = 256;
     
-    // Allocate memory for image
-    uint8_t* image = malloc(image_size);
-    if (!image) {
-        perror("malloc");
-        fclose(input_fp);
+    // New inodes and touched directories are stamped with --epoch, else
+    // SOURCE_DATE_EPOCH, else the clock
+    uint64_t now = (uint64_t)time(NULL);
+    const char* epoch_env = getenv("SOURCE_DATE_EPOCH");
+    if (epoch_arg && parse_epoch(epoch_arg, &now) != 0) {
+        fprintf(stderr, "Error: epoch must be a non-negative number of seconds\n");
+        return 1;
+    }
+    if (!epoch_arg && epoch_env && parse_epoch(epoch_env, &now) != 0) {
+        fprintf(stderr, "Error: SOURCE_DATE_EPOCH must be a non-negative number of seconds\n");
         return 1;
     }
     
-    // Read entire image
-    if (fread(image, 1, image_size, input_fp) != image_size) {
-        fprintf(stderr, "Error reading input file\n");
-        free(image);
-        fclose(input_fp);
+    // Load input filesystem image: a private copy, or a shared mapping when
+    // updating in place
+    fs_t fs = { .img = { .fd = -1, .dirty_lock = PTHREAD_MUTEX_INITIALIZER },
+                .policy = policy, .zero_copy = zero_copy,
+                .stats = stats, .compress = compress };
+    if ((in_place ? image_map(&fs.img, input_file) : image_load(&fs.img, input_file)) != 0) {
         return 1;
     }
-    fclose(input_fp);
+    // Zero-copy into a private mapping drops the pages under each copied
+    // block, which only works block by block when pages are no larger
+    if (fs.img.journaled && sysconf(_SC_PAGESIZE) > (long)BS) fs.zero_copy = 0;
+    uint8_t* image = fs.img.base;
     
     // Parse superblock
     superblock_t* sb = (superblock_t*)image;
     
     // Verify magic number
-    if (sb->magic != 0x4653564D) {
+    if (sb->magic != MINIVSFS_MAGIC) {
         fprintf(stderr, "Error: invalid filesystem magic number\n");
-        free(image);
+        image_release(&fs.img);
         return 1;
     }
     
-    // Get pointers to filesystem structures
-    uint8_t* inode_bitmap = image + sb->inode_bitmap_start * BS;
-    uint8_t* data_bitmap = image + sb->data_bitmap_start * BS;
-    inode_t* inode_table = (inode_t*)(image + sb->inode_table_start * BS);
-    uint8_t* data_region = image + sb->data_region_start * BS;
+    // The layout must fit inside the file, otherwise a mapped access faults
+    if (sb->total_blocks > fs.img.size / BS) {
+        fprintf(stderr, "Error: image truncated (%zu bytes, expected %" PRIu64 ")\n",
+                fs.img.size, sb->total_blocks * BS);
+        image_release(&fs.img);
+        return 1;
+    }
     
-    // Find free inode
-    int free_inode = find_free_bit(inode_bitmap, sb->inode_count);
-    if (free_inode == -1) {
-        fprintf(stderr, "Error: no free inodes\n");
-        free(image);
+    // Every region, the journal included, must lie inside the image and
+    // the bitmaps and inode table must cover every inode and data block
+    if (!superblock_layout_ok(sb, fs.img.size / BS)) {
+        fprintf(stderr, "Error: filesystem layout out of range\n");
+        image_release(&fs.img);
         return 1;
     }
     
-    // Calculate number of data blocks needed
-    size_t blocks_needed = 0;
-    if (file_size > 0) {
-        blocks_needed = (file_size + BS - 1) / BS;
-        if (blocks_needed > 12) {
-            fprintf(stderr, "Error: file requires too many blocks\n");
-            free(image);
+    // An image with a journal must be replayed before anything else reads it
+    if (sb->flags & SB_FLAG_JOURNAL) {
+        if (journal_replay(&fs.img) != 0) {
+            fprintf(stderr, "Error replaying journal\n");
+            image_release(&fs.img);
             return 1;
         }
     }
     
-    // Find free data blocks (only if file is not empty)
-    uint32_t data_blocks[12] = {0};
-    if (blocks_needed > 0) {
-        for (size_t i = 0; i < blocks_needed; i++) {
-            int free_block = find_free_bit(data_bitmap, sb->data_region_blocks);
-            if (free_block == -1) {
-                fprintf(stderr, "Error: no free data blocks\n");
-                free(image);
-                return 1;
-            }
-            data_blocks[i] = sb->data_region_start + free_block;
-            set_bit(data_bitmap, free_block);
-        }
-    }
+    // Get pointers to filesystem structures
+    fs.sb = sb;
+    bitmap_init(&fs.inodes, block_ptr(image, sb->inode_bitmap_start), sb->inode_count);
+    bitmap_init(&fs.blocks, block_ptr(image, sb->data_bitmap_start), sb->data_region_blocks);
+    fs.inode_table = (inode_t*)block_ptr(image, sb->inode_table_start);
+    fs.now = now;
     
-    // Read file content and copy to filesystem blocks
-    if (blocks_needed > 0) {
-        FILE* add_fp = fopen(add_file, "rb");
-        if (!add_fp) {
-            perror("fopen add_file");
-            free(image);
-            return 1;
-        }
-        
-        // Copy file data to filesystem blocks
-        for (size_t i = 0; i < blocks_needed; i++) {
-            uint8_t* block_ptr = image + data_blocks[i] * BS;
-            size_t bytes_to_read = (i == blocks_needed - 1) ? 
-                (file_size - i * BS) : BS;
-            
-            if (fread(block_ptr, 1, bytes_to_read, add_fp) != bytes_to_read) {
-                fprintf(stderr, "Error reading file data\n");
-                fclose(add_fp);
-                free(image);
-                return 1;
-            }
-            
-            // Zero-pad the last block if needed
-            if (bytes_to_read < BS) {
-                memset(block_ptr + bytes_to_read, 0, BS - bytes_to_read);
-            }
+    // Index the root directory once for the whole batch, and note which
+    // blocks hold directories for the journal
+    size_t dir_bytes = (sb->data_region_blocks + 63) / 64 * 8;
+    uint8_t* dir_bits = calloc(dir_bytes ? dir_bytes : 8, 1);
+    if (!dir_bits || dir_open(&fs, &fs.root, ROOT_INO) != 0) {
+        if (!dir_bits) perror("calloc");
+        free(dir_bits);
+        dir_index_free(&fs.root.index);
+        image_release(&fs.img);
+        return 1;
+    }
+    bitmap_init(&fs.dir_blocks, dir_bits, sb->data_region_blocks);
+    for (int k = 0; k < DIRECT_MAX; k++) {
+        uint32_t block = fs.root.inode->direct[k];
+        if (block >= sb->data_region_start && block < sb->data_region_start + sb->data_region_blocks) {
+            dir_block_track(&fs, block);
         }
-        fclose(add_fp);
     }
     
-    // Create new inode
-    time_t now = time(NULL);
-    inode_t* new_inode = &inode_table[free_inode];
-    memset(new_inode, 0, sizeof(inode_t));
-    
-    new_inode->mode = 0100000;  // Regular file
-    new_inode->links = 1;
-    new_inode->uid = 0;
-    new_inode->gid = 0;
-    new_inode->size_bytes = file_size;
-    new_inode->atime = now;
-    new_inode->mtime = now;
-    new_inode->ctime = now;
-    
-    // Set direct block pointers
-    for (size_t i = 0; i < blocks_needed; i++) {
-        new_inode->direct[i] = data_blocks[i];
+    // Hash the blocks already in the image for --dedup, and map the free ones
+    fs.dedup.on = dedup;
+    if ((dedup && dedup_build(&fs) != 0) || free_map_build(&fs.free_map, &fs.blocks) != 0) {
+        free_map_destroy(&fs.free_map);
+        dir_index_free(&fs.root.index);
+        free(dir_bits);
+        dedup_free(&fs.dedup);
+        image_release(&fs.img);
+        return 1;
     }
     
-    new_inode->proj_id = 5;  // Group ID
-    
-    // Mark inode as used
-    set_bit(inode_bitmap, free_inode);
-    
-    // Add directory entry to root directory
-    inode_t* root_inode = &inode_table[0]; // Root is inode #1, but 0-indexed
-    
-    // Find free directory entry slot and check for duplicates
-    uint8_t* root_data = image + root_inode->direct[0] * BS;
-    dirent64_t* entries = (dirent64_t*)root_data;
-    
-    int entries_per_block = BS / sizeof(dirent64_t);
-    int free_entry = -1;
-    int used_entries = 0;
-    
-    // Count used entries and check for duplicates
-    for (int i = 0; i < entries_per_block; i++) {
-        if (entries[i].inode_no != 0) {
-            used_entries++;
-            // Check for duplicate filename
-            if (strcmp(entries[i].name, add_file) == 0) {
-                fprintf(stderr, "Error: file '%s' already exists in filesystem\n", add_file);
-                free(image);
-                return 1;
-            }
-        } else if (free_entry == -1) {
-            free_entry = i;
+    // Add or remove every source in order; stop at the first failure. Paths
+    // from consecutive --file and --manifest sources are added as one batch,
+    // and a manifest that cannot be read still lets the paths before it in.
+    int failed = 0;
+    path_list_t batch = { 0 };
+    for (int i = 0; i < source_count && !failed; i++) {
+        if (source_kind[i] == SOURCE_TREE) {
+            failed = add_tree(&fs, sources[i], (int)threads) != 0;
+            continue;
         }
+        if (source_kind[i] == SOURCE_REMOVE) {
+            failed = remove_path(&fs, sources[i]) != 0;
+            continue;
+        }
+        int rc = source_kind[i] == SOURCE_MANIFEST ? read_manifest(&batch, sources[i])
+                                                   : path_list_push(&batch, sources[i]);
+        if (rc != 0 || i + 1 == source_count || source_kind[i + 1] > SOURCE_MANIFEST) {
+            failed = add_files(&fs, batch.paths, batch.count, (int)threads) != 0 || rc != 0;
+            path_list_free(&batch);
+        }
+    }
+    path_list_free(&batch);
+    free(sources);
+    free(source_kind);
+    dir_index_free(&fs.root.index);
+    
+    if (dedup) {
+        uint64_t stored = fs.dedup.logical - fs.dedup.shared;
+        printf("Dedup: %" PRIu64 " of %" PRIu64 " data block(s) shared", fs.dedup.shared, fs.dedup.logical);
+        if (stored > 0) printf(", ratio %.2f:1", (double)fs.dedup.logical / stored);
+        printf(", %" PRIu64 " KiB saved\n", fs.dedup.shared * (BS / 1024));
     }
+    dedup_free(&fs.dedup);
     
-    if (free_entry == -1) {
-        fprintf(stderr, "Error: root directory full\n");
-        free(image);
+    // A failed batch produces no output image. In place, the files added or
+    // removed before the failure are already in the mapping, so they are
+    // committed to keep the image consistent.
+    if (failed && (!in_place || fs.added + fs.removed == 0)) {
+        free_map_destroy(&fs.free_map);
+        free(fs.deferred);
+        free(dir_bits);
+        image_release(&fs.img);
         return 1;
     }
     
-    // Create directory entry
-    dirent64_t* new_entry = &entries[free_entry];
-    new_entry->inode_no = free_inode + 1; // 1-indexed
-    new_entry->type = 1; // File
-    memset(new_entry->name, 0, 58);
-    strncpy(new_entry->name, add_file, 57);
-    new_entry->name[57] = '\0'; // Ensure null termination
-    
-    // Update root inode - only size increases as we add one more entry
-    root_inode->size_bytes = (used_entries + 1) * sizeof(dirent64_t);
-    root_inode->mtime = now;
-    
-    // Finalize checksums
-    dirent_checksum_finalize(new_entry);
-    inode_crc_finalize(new_inode);
-    inode_crc_finalize(root_inode);
-    superblock_crc_finalize(sb);
-    
-    // Write output file
-    FILE* output_fp = fopen(output_file, "wb");
-    if (!output_fp) {
-        perror("fopen output");
-        free(image);
+    // Finalize the root inode once for the whole batch (the superblock CRC
+    // was already patched if its flags changed) and, in place, flush
+    uint64_t crc_start = crc_bytes_hashed;
+    int commit_rc = fs_commit(&fs);
+    free_map_destroy(&fs.free_map);
+    free(fs.deferred);
+    free(dir_bits);
+    if (commit_rc != 0) {
+        fprintf(stderr, "Error syncing image\n");
+        image_release(&fs.img);
         return 1;
     }
+    if (fs.stats) {
+        printf("Batch: %" PRIu64 " CRC byte(s) hashed, %" PRIu64 " at commit\n",
+               crc_bytes_hashed, crc_bytes_hashed - crc_start);
+    }
     
-    if (fwrite(image, 1, image_size, output_fp) != image_size) {
-        fprintf(stderr, "Error writing output file\n");
+    if (!in_place) {
+        // Write output file
+        FILE* output_fp = fopen(output_file, "wb");
+        if (!output_fp) {
+            perror("fopen output");
+            image_release(&fs.img);
+            return 1;
+        }
+        
+        if (fwrite(image, 1, fs.img.size, output_fp) != fs.img.size) {
+            fprintf(stderr, "Error writing output file\n");
+            fclose(output_fp);
+            image_release(&fs.img);
+            return 1;
+        }
+        
         fclose(output_fp);
-        free(image);
-        return 1;
     }
     
-    fclose(output_fp);
-    free(image);
+    image_release(&fs.img);
     
-    printf("Successfully added '%s' to filesystem\n", add_file);
+    if (failed) {
+        if (fs.removed > 0) {
+            fprintf(stderr, "Error: stopped after adding %d and removing %d file(s)\n", fs.added, fs.removed);
+        } else {
+            fprintf(stderr, "Error: stopped after adding %d file(s)\n", fs.added);
+        }
+        return 1;
+    }
     return 0;
 }
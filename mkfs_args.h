@@ -0,0 +1,27 @@
+// Command-line parsing shared by mkfs_builder and mkfs_adder. Header-only,
+// like minivsfs_format.h, so each tool still builds from one command.
+#ifndef MINIVSFS_MKFS_ARGS_H
+#define MINIVSFS_MKFS_ARGS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <errno.h>
+
+// Parse a non-negative decimal number: digits only, nothing after them and
+// in range, else -1
+static inline int parse_u64(const char* s, uint64_t* out) {
+    char* end;
+    errno = 0;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*s < '0' || *s > '9' || *end != '\0' || errno == ERANGE) return -1;
+    *out = v;
+    return 0;
+}
+
+// Parse a timestamp in seconds since 1970, as --epoch and SOURCE_DATE_EPOCH
+// give it
+static inline int parse_epoch(const char* s, uint64_t* out) {
+    return parse_u64(s, out);
+}
+
+#endif // MINIVSFS_MKFS_ARGS_H
@@ -1,5 +1,6 @@
 // Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c -o mkfs_builder
 #define _FILE_OFFSET_BITS 64
+#define _POSIX_C_SOURCE 200809L
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
@@ -8,127 +9,42 @@
 #include <errno.h>
 #include <time.h>
 #include <assert.h>
+#include <fcntl.h>
+#include <unistd.h>
 
-#define BS 4096u               // block size
-#define INODE_SIZE 128u
-#define ROOT_INO 1u
+#include "minivsfs_format.h"
+#include "mkfs_args.h"
 
-uint64_t g_random_seed = 0; // This should be replaced by seed value from the CLI.
+// Format limits: block numbers (direct[], indirect pointers) and inode
+// numbers (dirent64_t.inode_no) are 32-bit on disk
+#define MIN_SIZE_KIB 180ull
+#define MAX_SIZE_KIB ((uint64_t)UINT32_MAX * (BS / 1024))
+#define MIN_INODES 128ull
+#define MAX_INODES ((uint64_t)UINT32_MAX - 1)
 
-// below contains some basic structures you need for your project
-// you are free to create more structures as you require
+// Optional metadata journal: a header block plus up to 509 log blocks
+#define MIN_JOURNAL_BLOCKS 64ull
+#define MAX_JOURNAL_BLOCKS 510ull
 
-#pragma pack(push, 1)
-typedef struct {
-    uint32_t magic;                 // 0x4D565346
-    uint32_t version;               // 1
-    uint32_t block_size;            // 4096
-    uint64_t total_blocks;          // size_kib * 1024 / 4096
-    uint64_t inode_count;           // number of inodes
-    uint64_t inode_bitmap_start;    // block number where inode bitmap starts
-    uint64_t inode_bitmap_blocks;   // number of blocks for inode bitmap
-    uint64_t data_bitmap_start;     // block number where data bitmap starts
-    uint64_t data_bitmap_blocks;    // number of blocks for data bitmap
-    uint64_t inode_table_start;     // block number where inode table starts
-    uint64_t inode_table_blocks;    // number of blocks for inode table
-    uint64_t data_region_start;     // block number where data region starts
-    uint64_t data_region_blocks;    // number of blocks for data region
-    uint64_t root_inode;            // 1
-    uint64_t mtime_epoch;           // build time
-    uint32_t flags;                 // 0
-    uint32_t checksum;              // crc32(superblock[0..4091])
-} superblock_t;
-#pragma pack(pop)
-_Static_assert(sizeof(superblock_t) == 116, "superblock must fit in one block");
-
-#pragma pack(push,1)
-typedef struct {
-    uint16_t mode;          // file type: 0100000 (octal) for files, 0040000 (octal) for dirs
-    uint16_t links;         // number of directories pointing to this inode
-    uint32_t uid;           // user id (0)
-    uint32_t gid;           // group id (0)
-    uint64_t size_bytes;    // size in bytes
-    uint64_t atime;         // access time
-    uint64_t mtime;         // modify time
-    uint64_t ctime;         // create time
-    uint32_t direct[12];    // direct block pointers
-    uint32_t reserved_0;    // 0
-    uint32_t reserved_1;    // 0
-    uint32_t reserved_2;    // 0
-    uint32_t proj_id;       // your group ID
-    uint32_t uid16_gid16;   // 0
-    uint64_t xattr_ptr;     // 0
-    uint64_t inode_crc;     // checksum
-} inode_t;
-#pragma pack(pop)
-_Static_assert(sizeof(inode_t)==INODE_SIZE, "inode size mismatch");
-
-#pragma pack(push,1)
-typedef struct {
-    uint32_t inode_no;      // inode number (0 if free)
-    uint8_t  type;          // 1=file, 2=dir
-    char     name[58];      // filename
-    uint8_t  checksum;      // XOR of bytes 0..62
-} dirent64_t;
-#pragma pack(pop)
-_Static_assert(sizeof(dirent64_t)==64, "dirent size mismatch");
-
-
-// ==========================DO NOT CHANGE THIS PORTION=========================
-// These functions are there for your help. You should refer to the specifications to see how you can use them.
-// ====================================CRC32====================================
-uint32_t CRC32_TAB[256];
-void crc32_init(void){
-    for (uint32_t i=0;i<256;i++){
-        uint32_t c=i;
-        for(int j=0;j<8;j++) c = (c&1)?(0xEDB88320u^(c>>1)):(c>>1);
-        CRC32_TAB[i]=c;
-    }
-}
-uint32_t crc32(const void* data, size_t n){
-    const uint8_t* p=(const uint8_t*)data; uint32_t c=0xFFFFFFFFu;
-    for(size_t i=0;i<n;i++) c = CRC32_TAB[(c^p[i])&0xFF] ^ (c>>8);
-    return c ^ 0xFFFFFFFFu;
-}
-// ====================================CRC32====================================
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-static uint32_t superblock_crc_finalize(superblock_t *sb) {
-    sb->checksum = 0;
-    uint32_t s = crc32((void *) sb, BS - 4);
-    sb->checksum = s;
-    return s;
-}
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void inode_crc_finalize(inode_t* ino){
-    uint8_t tmp[INODE_SIZE]; memcpy(tmp, ino, INODE_SIZE);
-    // zero crc area before computing
-    memset(&tmp[120], 0, 8);
-    uint32_t c = crc32(tmp, 120);
-    ino->inode_crc = (uint64_t)c; // low 4 bytes carry the crc
-}
-
-// WARNING: CALL THIS ONLY AFTER ALL OTHER SUPERBLOCK ELEMENTS HAVE BEEN FINALIZED
-void dirent_checksum_finalize(dirent64_t* de) {
-    const uint8_t* p = (const uint8_t*)de;
-    uint8_t x = 0;
-    for (int i = 0; i < 63; i++) x ^= p[i];   // covers ino(4) + type(1) + name(58)
-    de->checksum = x;
-}
+// --seed. No layout choice is random yet, so every seed builds the same
+// image; any future randomness must draw from this so builds stay
+// reproducible.
+uint64_t g_random_seed = 0;
 
 int main(int argc, char** argv) {
-    crc32_init();
-    
     // Parse CLI parameters with proper flags
-    if (argc != 7) {
-        fprintf(stderr, "Usage: %s --image <file> --size-kib <180..4096> --inodes <128..512>\n", argv[0]);
+    if (argc < 7 || argc > 13 || argc % 2 == 0) {
+        fprintf(stderr, "Usage: %s --image <file> --size-kib <180..%" PRIu64 "> --inodes <128..%" PRIu64 ">\n"
+                        "          [--journal-blocks <%llu..%llu>] [--seed <n>] [--epoch <seconds>]\n",
+                argv[0], MAX_SIZE_KIB, MAX_INODES, MIN_JOURNAL_BLOCKS, MAX_JOURNAL_BLOCKS);
         return 1;
     }
     
     const char* image_file = NULL;
     uint64_t size_kib = 0;
     uint64_t inode_count = 0;
+    uint64_t journal_blocks = 0;
+    const char* epoch_arg = NULL;
     
     // Parse arguments
     for (int i = 1; i < argc; i += 2) {
@@ -138,6 +54,20 @@ int main(int argc, char** argv) {
             size_kib = strtoull(argv[i + 1], NULL, 10);
         } else if (strcmp(argv[i], "--inodes") == 0) {
             inode_count = strtoull(argv[i + 1], NULL, 10);
+        } else if (strcmp(argv[i], "--journal-blocks") == 0) {
+            if (parse_u64(argv[i + 1], &journal_blocks) != 0 ||
+                journal_blocks < MIN_JOURNAL_BLOCKS || journal_blocks > MAX_JOURNAL_BLOCKS) {
+                fprintf(stderr, "Error: journal-blocks must be between %llu and %llu\n",
+                        MIN_JOURNAL_BLOCKS, MAX_JOURNAL_BLOCKS);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--seed") == 0) {
+            if (parse_u64(argv[i + 1], &g_random_seed) != 0) {
+                fprintf(stderr, "Error: seed must be a non-negative decimal number\n");
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--epoch") == 0) {
+            epoch_arg = argv[i + 1];
         } else {
             fprintf(stderr, "Unknown argument: %s\n", argv[i]);
             return 1;
@@ -151,68 +81,104 @@ int main(int argc, char** argv) {
     }
     
     // Validate ranges
-    if (size_kib < 180 || size_kib > 4096 || size_kib % 4 != 0) {
-        fprintf(stderr, "Error: size-kib must be between 180-4096 and multiple of 4\n");
+    if (size_kib < MIN_SIZE_KIB || size_kib > MAX_SIZE_KIB || size_kib % 4 != 0) {
+        fprintf(stderr, "Error: size-kib must be between %llu-%" PRIu64 " and multiple of 4\n",
+                MIN_SIZE_KIB, MAX_SIZE_KIB);
         return 1;
     }
     
-    if (inode_count < 128 || inode_count > 512) {
-        fprintf(stderr, "Error: inodes must be between 128 and 512\n");
+    if (inode_count < MIN_INODES || inode_count > MAX_INODES) {
+        fprintf(stderr, "Error: inodes must be between %llu and %" PRIu64 "\n",
+                MIN_INODES, MAX_INODES);
+        return 1;
+    }
+    
+    // Timestamps come from --epoch, else SOURCE_DATE_EPOCH, else the clock;
+    // pinning them makes the image a function of the arguments alone
+    uint64_t now = (uint64_t)time(NULL);
+    const char* epoch_env = getenv("SOURCE_DATE_EPOCH");
+    if (epoch_arg && parse_epoch(epoch_arg, &now) != 0) {
+        fprintf(stderr, "Error: epoch must be a non-negative number of seconds\n");
+        return 1;
+    }
+    if (!epoch_arg && epoch_env && parse_epoch(epoch_env, &now) != 0) {
+        fprintf(stderr, "Error: SOURCE_DATE_EPOCH must be a non-negative number of seconds\n");
         return 1;
     }
     
     // Calculate filesystem parameters
     uint64_t total_blocks = size_kib * 1024 / BS;
     
-    // Layout: superblock(1) + inode_bitmap(1) + data_bitmap(1) + inode_table + data
+    // Layout: superblock(1) + inode_bitmap + data_bitmap + inode_table
+    // [+ journal] + data. Each bitmap spans as many blocks as it needs bits
+    // (BS * 8 per block).
+    uint64_t bits_per_block = (uint64_t)BS * 8;
     uint64_t inode_bitmap_start = 1;
-    uint64_t data_bitmap_start = 2;
-    uint64_t inode_table_start = 3;
+    uint64_t inode_bitmap_blocks = (inode_count + bits_per_block - 1) / bits_per_block;
     
     // Calculate inode table size
     uint64_t inode_table_bytes = inode_count * INODE_SIZE;
     uint64_t inode_table_blocks = (inode_table_bytes + BS - 1) / BS;
     
-    uint64_t data_region_start = inode_table_start + inode_table_blocks;
-    uint64_t data_region_blocks = total_blocks - data_region_start;
+    // Size the data bitmap for every block not taken by the other metadata;
+    // that over-counts by the data bitmap itself, which is harmless
+    uint64_t meta_blocks = 1 + inode_bitmap_blocks + inode_table_blocks + journal_blocks;
+    if (meta_blocks >= total_blocks) {
+        fprintf(stderr, "Error: no space for data blocks\n");
+        return 1;
+    }
+    uint64_t data_bitmap_start = inode_bitmap_start + inode_bitmap_blocks;
+    uint64_t data_bitmap_blocks = (total_blocks - meta_blocks + bits_per_block - 1) / bits_per_block;
+    uint64_t inode_table_start = data_bitmap_start + data_bitmap_blocks;
     
-    if (data_region_blocks < 1) {
+    // The journal starts out as a hole: an all-zero header is an empty journal
+    uint64_t journal_start = journal_blocks ? inode_table_start + inode_table_blocks : 0;
+    uint64_t data_region_start = inode_table_start + inode_table_blocks + journal_blocks;
+    if (data_region_start >= total_blocks) {
         fprintf(stderr, "Error: no space for data blocks\n");
         return 1;
     }
+    uint64_t data_region_blocks = total_blocks - data_region_start;
     
-    // Create filesystem image in memory
-    size_t image_size = total_blocks * BS;
-    uint8_t* image = calloc(1, image_size);
-    if (!image) {
+    // Only five blocks of a fresh image hold anything: the superblock, the
+    // first block of each bitmap, the inode-table block with the root inode
+    // and the root directory block. Build just those in memory; the rest of
+    // the image is left as a hole.
+    enum { META_SB, META_INODE_BITMAP, META_DATA_BITMAP, META_INODE_TABLE, META_ROOT_DIR, META_COUNT };
+    uint64_t meta_block_no[META_COUNT] = {
+        0, inode_bitmap_start, data_bitmap_start, inode_table_start, data_region_start
+    };
+    size_t image_size = block_offset(total_blocks);
+    uint8_t* meta = calloc(META_COUNT, BS);
+    if (!meta) {
         perror("calloc");
         return 1;
     }
     
-    time_t now = time(NULL);
-    
     // Create superblock  
-    superblock_t* sb = (superblock_t*)image;
-    sb->magic = 0x4653564D;  // This will store as 4D 56 53 46 in little-endian
+    superblock_t* sb = block_ptr(meta, META_SB);
+    sb->magic = MINIVSFS_MAGIC;
     sb->version = 1;
     sb->block_size = BS;
     sb->total_blocks = total_blocks;
     sb->inode_count = inode_count;
     sb->inode_bitmap_start = inode_bitmap_start;
-    sb->inode_bitmap_blocks = 1;
+    sb->inode_bitmap_blocks = inode_bitmap_blocks;
     sb->data_bitmap_start = data_bitmap_start;
-    sb->data_bitmap_blocks = 1;
+    sb->data_bitmap_blocks = data_bitmap_blocks;
     sb->inode_table_start = inode_table_start;
     sb->inode_table_blocks = inode_table_blocks;
     sb->data_region_start = data_region_start;
     sb->data_region_blocks = data_region_blocks;
     sb->root_inode = 1;
-    sb->mtime_epoch = (uint64_t)now;
-    sb->flags = 0;
+    sb->mtime_epoch = now;
+    sb->flags = journal_blocks ? SB_FLAG_JOURNAL : 0;
+    sb->journal_start = journal_start;
+    sb->journal_blocks = journal_blocks;
     
     // Set up bitmaps
-    uint8_t* inode_bitmap = image + inode_bitmap_start * BS;
-    uint8_t* data_bitmap = image + data_bitmap_start * BS;
+    uint8_t* inode_bitmap = block_ptr(meta, META_INODE_BITMAP);
+    uint8_t* data_bitmap = block_ptr(meta, META_DATA_BITMAP);
     
     // Mark root inode as used (inode #1 = bit 0)
     inode_bitmap[0] |= 0x01;
@@ -221,28 +187,28 @@ int main(int argc, char** argv) {
     data_bitmap[0] |= 0x01;
     
     // Create root inode
-    inode_t* root_inode = (inode_t*)(image + inode_table_start * BS);
+    inode_t* root_inode = block_ptr(meta, META_INODE_TABLE);
     root_inode->mode = 0040000;  // This is correct: 040000 octal = 16384 decimal = 0x4000
     root_inode->links = 2;      // "." and ".."
     root_inode->uid = 0;
     root_inode->gid = 0;
     root_inode->size_bytes = 128; // 2 directory entries * 64 bytes
-    root_inode->atime = (uint64_t)now;
-    root_inode->mtime = (uint64_t)now;
-    root_inode->ctime = (uint64_t)now;
+    root_inode->atime = now;
+    root_inode->mtime = now;
+    root_inode->ctime = now;
     root_inode->direct[0] = data_region_start;  // ABSOLUTE block number
     for (int i = 1; i < 12; i++) {
         root_inode->direct[i] = 0; // unused
     }
-    root_inode->reserved_0 = 0;
-    root_inode->reserved_1 = 0;
-    root_inode->reserved_2 = 0;
+    root_inode->indirect = 0;
+    root_inode->double_indirect = 0;
+    root_inode->iflags = 0;
     root_inode->proj_id = 5;  // Fixed group ID
     root_inode->uid16_gid16 = 0;
     root_inode->xattr_ptr = 0;
     
     // Create root directory entries
-    uint8_t* root_dir_block = image + data_region_start * BS;
+    uint8_t* root_dir_block = block_ptr(meta, META_ROOT_DIR);
     
     // "." entry
     dirent64_t* dot_entry = (dirent64_t*)root_dir_block;
@@ -264,27 +230,42 @@ int main(int argc, char** argv) {
     inode_crc_finalize(root_inode);
     superblock_crc_finalize(sb);
     
-    // Write to file
-    FILE* f = fopen(image_file, "wb");
-    if (!f) {
-        perror("fopen");
-        free(image);
+    // Write to file: size it with ftruncate, which reads back as zeros, and
+    // pwrite only the metadata blocks
+    int fd = open(image_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("open");
+        free(meta);
         return 1;
     }
     
-    if (fwrite(image, 1, image_size, f) != image_size) {
-        perror("fwrite");
-        fclose(f);
-        free(image);
+    if (ftruncate(fd, (off_t)image_size) != 0) {
+        perror("ftruncate");
+        close(fd);
+        free(meta);
         return 1;
     }
     
-    fclose(f);
-    free(image);
+    for (int i = 0; i < META_COUNT; i++) {
+        if (pwrite(fd, block_ptr(meta, i), BS, (off_t)block_offset(meta_block_no[i])) != (ssize_t)BS) {
+            perror("pwrite");
+            close(fd);
+            free(meta);
+            return 1;
+        }
+    }
+    
+    if (close(fd) != 0) {
+        perror("close");
+        free(meta);
+        return 1;
+    }
+    free(meta);
     
     printf("MiniVSFS created: %s\n", image_file);
     printf("Size: %lu KiB (%lu blocks)\n", size_kib, total_blocks);
     printf("Inodes: %lu\n", inode_count);
+    if (journal_blocks) printf("Journal: %lu blocks at block %lu\n", journal_blocks, journal_start);
     
     return 0;
 }
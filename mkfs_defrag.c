@@ -0,0 +1,575 @@
+// Build: gcc -O2 -std=c17 -Wall -Wextra mkfs_defrag.c -o mkfs_defrag
+// Usage: mkfs_defrag --image <file> [--output <file>] [--shrink] [--dry-run]
+//
+// Repacks the data region of a MiniVSFS image so that each file's blocks are
+// contiguous, laid out the way mkfs_adder allocates them (pointer blocks
+// right before the data they map), and all free space is one run at the end.
+// Directories are placed breadth-first from the root, each followed by its
+// files in dirent order. A block shared by several files (mkfs_adder
+// --dedup) stays shared and goes with the first file that uses it.
+// Compressed files move as they are: their chunk maps hold offsets within
+// the file, not block numbers. The pointer blocks, direct[] pointers, inode
+// CRCs and the data bitmap are rewritten to match.
+//
+// The moves are planned first, then run in windows of WINDOW_BLOCKS target
+// blocks: every block bound for the window is read (adjacent ones in one
+// pread), blocks still sitting in the window that belong further on are
+// moved into the places just vacated, and the window is written back in one
+// pwrite. The metadata is written last.
+//
+// With --output the compacted image goes to a new file and the input is
+// only read. Otherwise the image is rewritten in place, which is not
+// crash-safe: keep a copy until it finishes. --shrink cuts the data region,
+// and the file, down to the blocks in use; without it the free tail is
+// punched out of an in-place image. --dry-run prints the plan only.
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "minivsfs.h"
+
+#define WINDOW_BLOCKS 2048u     // 8 MiB moved per batch
+#define NONE UINT32_MAX
+
+typedef struct {
+    const uint8_t* base;        // read-only mapping of the input image
+    size_t size;
+    const superblock_t* sb;
+    const inode_t* inode_table;
+    const uint8_t* inode_bitmap;
+    const uint8_t* data_bitmap;
+
+    // The plan, over data bitmap bits
+    uint32_t* target;           // target[b]: where the block at bit b goes, NONE until placed
+    uint32_t* source;           // source[t]: the bit whose block goes to t
+    uint8_t* is_map;            // bit b holds block pointers
+    uint64_t used;              // blocks placed so far
+    uint8_t* seen;              // seen[ino]: inode placed or queued
+    uint32_t* queue;            // directories whose entries are still to be placed
+    size_t queue_head, queue_tail;
+
+    uint64_t files, dirs;
+    uint64_t extents_before, extents_after;
+    uint32_t prev;              // last block placed for the current inode, or NONE
+} defrag_t;
+
+static int bit_set(const uint8_t* bitmap, uint64_t bit) {
+    return (bitmap[bit / 8] >> (bit % 8)) & 1;
+}
+
+// Data bitmap bit of a block an inode points at. Blocks outside the data
+// region or free in the data bitmap mean the image is damaged; mkfs_check
+// tells more.
+static int data_bit(const defrag_t* d, uint32_t ino, uint32_t block, uint32_t* bit) {
+    const superblock_t* sb = d->sb;
+    if (block < sb->data_region_start || block - sb->data_region_start >= sb->data_region_blocks ||
+        !bit_set(d->data_bitmap, block - sb->data_region_start)) {
+        fprintf(stderr, "Error: inode %" PRIu32 " points at block %" PRIu32
+                " outside the used data region (run mkfs_check)\n", ino, block);
+        return -1;
+    }
+    *bit = block - sb->data_region_start;
+    return 0;
+}
+
+// Give a block the next target position unless an earlier file (sharing it)
+// already did, and count the extents of the current inode before and after
+static int place(defrag_t* d, uint32_t ino, uint32_t block) {
+    uint32_t bit;
+    if (data_bit(d, ino, block, &bit) != 0) return -1;
+    if (d->target[bit] == NONE) {
+        d->target[bit] = (uint32_t)d->used;
+        d->source[d->used++] = bit;
+    }
+    d->extents_before += d->prev == NONE || bit != d->prev + 1;
+    d->extents_after += d->prev == NONE || d->target[bit] != d->target[d->prev] + 1;
+    d->prev = bit;
+    return 0;
+}
+
+// Place a pointer block, then each block it maps: the data blocks, or for
+// the double-indirect block each second-level block followed by its data
+static int place_map(defrag_t* d, uint32_t ino, uint32_t map, uint64_t* left, int depth) {
+    if (place(d, ino, map) != 0) return -1;
+    d->is_map[map - d->sb->data_region_start] = 1;
+    const uint32_t* ptr = (const uint32_t*)block_ptr(d->base, map);
+    for (size_t i = 0; i < PTRS_PER_BLOCK && *left > 0; i++) {
+        if (ptr[i] == 0) {
+            fprintf(stderr, "Error: inode %" PRIu32 " has a hole in pointer block %" PRIu32 "\n", ino, map);
+            return -1;
+        }
+        if (depth > 1) {
+            if (place_map(d, ino, ptr[i], left, depth - 1) != 0) return -1;
+        } else {
+            if (place(d, ino, ptr[i]) != 0) return -1;
+            (*left)--;
+        }
+    }
+    return 0;
+}
+
+// Place every block of inode "ino" in its layout order. Directories use
+// whichever direct blocks are set; files use ceil(size / BS) blocks, or the
+// count in their chunk map if compressed.
+static int place_inode(defrag_t* d, uint32_t ino) {
+    const inode_t* inode = &d->inode_table[ino - 1];
+    d->prev = NONE;
+    if (inode->mode == 0040000) {
+        d->dirs++;
+        for (int k = 0; k < DIRECT_MAX; k++) {
+            if (inode->direct[k] != 0 && place(d, ino, inode->direct[k]) != 0) return -1;
+        }
+        return 0;
+    }
+    if (inode->mode != 0100000) {
+        fprintf(stderr, "Error: inode %" PRIu32 " has unknown mode %06o\n", ino, inode->mode);
+        return -1;
+    }
+
+    d->files++;
+    uint64_t left = (inode->size_bytes + BS - 1) / BS;
+    if ((inode->iflags & INODE_FLAG_COMPRESSED) && left > 0) {
+        uint32_t bit;
+        if (data_bit(d, ino, inode->direct[0], &bit) != 0) return -1;
+        const chunk_map_t* cm = (const chunk_map_t*)block_ptr(d->base, inode->direct[0]);
+        if (cm->stored_blocks == 0 || cm->stored_blocks > left) {
+            fprintf(stderr, "Error: inode %" PRIu32 " has a bad chunk map\n", ino);
+            return -1;
+        }
+        left = cm->stored_blocks;
+    }
+    for (int k = 0; k < DIRECT_MAX && left > 0; k++, left--) {
+        if (place(d, ino, inode->direct[k]) != 0) return -1;
+    }
+    if (left > 0 && inode->indirect && place_map(d, ino, inode->indirect, &left, 1) != 0) return -1;
+    if (left > 0 && inode->double_indirect && place_map(d, ino, inode->double_indirect, &left, 2) != 0) {
+        return -1;
+    }
+    if (left > 0) {
+        fprintf(stderr, "Error: inode %" PRIu32 " has %" PRIu64 " unmapped block(s)\n", ino, left);
+        return -1;
+    }
+    return 0;
+}
+
+// Place the root directory, then each directory breadth-first: its own
+// blocks, then the files it names in slot order. Inodes no directory names
+// and used blocks no inode names follow, so nothing in use is dropped.
+static int plan(defrag_t* d) {
+    const superblock_t* sb = d->sb;
+    d->seen[ROOT_INO] = 1;
+    d->queue[d->queue_tail++] = ROOT_INO;
+    while (d->queue_head < d->queue_tail) {
+        uint32_t dir = d->queue[d->queue_head++];
+        if (place_inode(d, dir) != 0) return -1;
+        const inode_t* inode = &d->inode_table[dir - 1];
+        for (int k = 0; k < DIRECT_MAX; k++) {
+            if (inode->direct[k] == 0) continue;
+            const dirent64_t* de = (const dirent64_t*)block_ptr(d->base, inode->direct[k]);
+            for (size_t e = 0; e < BS / sizeof(dirent64_t); e++, de++) {
+                uint32_t ino = de->inode_no;
+                if (ino == 0 || strcmp(de->name, ".") == 0 || strcmp(de->name, "..") == 0) continue;
+                if (ino > sb->inode_count || !bit_set(d->inode_bitmap, ino - 1)) {
+                    fprintf(stderr, "Error: directory inode %" PRIu32 " names free inode %" PRIu32
+                            " (run mkfs_check)\n", dir, ino);
+                    return -1;
+                }
+                if (d->seen[ino]) continue;
+                d->seen[ino] = 1;
+                if (d->inode_table[ino - 1].mode == 0040000) {
+                    d->queue[d->queue_tail++] = ino;
+                } else if (place_inode(d, ino) != 0) {
+                    return -1;
+                }
+            }
+        }
+    }
+
+    for (uint32_t ino = 1; ino <= sb->inode_count; ino++) {
+        if (!bit_set(d->inode_bitmap, ino - 1) || d->seen[ino]) continue;
+        d->seen[ino] = 1;
+        if (place_inode(d, ino) != 0) return -1;
+    }
+    for (uint64_t bit = 0; bit < sb->data_region_blocks; bit++) {
+        if (bit_set(d->data_bitmap, bit) && d->target[bit] == NONE) {
+            d->target[bit] = (uint32_t)d->used;
+            d->source[d->used++] = (uint32_t)bit;
+        }
+    }
+    return 0;
+}
+
+// New number of a block pointer; pointers the plan never reached are kept
+static uint32_t remap(const defrag_t* d, uint32_t block) {
+    const superblock_t* sb = d->sb;
+    if (block < sb->data_region_start || block - sb->data_region_start >= sb->data_region_blocks) return block;
+    uint32_t t = d->target[block - sb->data_region_start];
+    return t == NONE ? block : (uint32_t)sb->data_region_start + t;
+}
+
+static int read_blocks(int fd, uint8_t* buf, uint64_t block, size_t count) {
+    if (pread(fd, buf, (size_t)count * BS, (off_t)block_offset(block)) != (ssize_t)(count * BS)) {
+        perror("pread");
+        return -1;
+    }
+    return 0;
+}
+
+static int write_blocks(int fd, const uint8_t* buf, uint64_t block, size_t count) {
+    if (pwrite(fd, buf, (size_t)count * BS, (off_t)block_offset(block)) != (ssize_t)(count * BS)) {
+        perror("pwrite");
+        return -1;
+    }
+    return 0;
+}
+
+// Carry out the plan, window by window. In place, cur[] tracks where each
+// block (by its original bit) sits now and occ[] which block sits at each
+// bit; a block is read from cur[] and the window's other occupants are
+// evicted to the bits its blocks vacate. There are always enough of those:
+// each block bound for the window from outside frees one bit, and only
+// blocks from outside can leave the window's bits occupied by strangers.
+static int move_blocks(defrag_t* d, int in_fd, int out_fd, uint64_t* moved, uint64_t* batches) {
+    const uint64_t drs = d->sb->data_region_start;
+    const uint64_t n = d->sb->data_region_blocks;
+    int in_place = in_fd == out_fd;
+    uint8_t* buf = malloc((size_t)WINDOW_BLOCKS * BS);
+    uint8_t* evict_buf = in_place ? malloc((size_t)WINDOW_BLOCKS * BS) : NULL;
+    uint32_t* cur = in_place ? malloc(n * sizeof(uint32_t)) : NULL;
+    uint32_t* occ = in_place ? malloc(n * sizeof(uint32_t)) : NULL;
+    uint32_t* evict = in_place ? malloc(WINDOW_BLOCKS * sizeof(uint32_t)) : NULL;
+    uint32_t* vacated = in_place ? malloc(WINDOW_BLOCKS * sizeof(uint32_t)) : NULL;
+    int rc = -1;
+    if (!buf || (in_place && (!evict_buf || !cur || !occ || !evict || !vacated))) {
+        perror("malloc");
+        goto out;
+    }
+    for (uint64_t b = 0; in_place && b < n; b++) {
+        cur[b] = (uint32_t)b;
+        occ[b] = bit_set(d->data_bitmap, b) ? (uint32_t)b : NONE;
+    }
+
+    for (uint64_t t0 = 0; t0 < d->used; t0 += WINDOW_BLOCKS) {
+        uint64_t t1 = t0 + WINDOW_BLOCKS < d->used ? t0 + WINDOW_BLOCKS : d->used;
+        size_t changed = 0;
+        for (uint64_t t = t0; t < t1; t++) {
+            changed += (in_place ? cur[d->source[t]] : d->source[t]) != t;
+        }
+        *moved += changed;
+        if (in_place && changed == 0) continue;
+        (*batches)++;
+
+        // Gather the window's blocks, one pread per run of adjacent sources
+        for (uint64_t t = t0; t < t1; ) {
+            uint64_t from = in_place ? cur[d->source[t]] : d->source[t];
+            size_t run = 1;
+            while (t + run < t1 && (in_place ? cur[d->source[t + run]] : d->source[t + run]) == from + run) run++;
+            if (read_blocks(in_fd, buf + (t - t0) * BS, drs + from, run) != 0) goto out;
+            t += run;
+        }
+
+        if (in_place) {
+            // Blocks in the window that go further on, and the bits outside
+            // it that the gather emptied, both in ascending order
+            size_t evictions = 0, vacancies = 0;
+            for (uint64_t b = t0; b < t1; b++) {
+                if (occ[b] != NONE && d->target[occ[b]] >= t1) evict[evictions++] = (uint32_t)b;
+            }
+            for (uint64_t t = t0; t < t1; t++) {
+                if (cur[d->source[t]] >= t1) vacated[vacancies++] = cur[d->source[t]];
+            }
+            for (size_t i = 1; i < vacancies; i++) {
+                uint32_t v = vacated[i];
+                size_t j = i;
+                for (; j > 0 && vacated[j - 1] > v; j--) vacated[j] = vacated[j - 1];
+                vacated[j] = v;
+            }
+
+            for (size_t i = 0; i < evictions; ) {
+                size_t run = 1;
+                while (i + run < evictions && evict[i + run] == evict[i] + run) run++;
+                if (read_blocks(in_fd, evict_buf + i * BS, drs + evict[i], run) != 0) goto out;
+                i += run;
+            }
+            for (size_t i = 0; i < evictions; ) {
+                size_t run = 1;
+                while (i + run < evictions && vacated[i + run] == vacated[i] + run) run++;
+                if (write_blocks(out_fd, evict_buf + i * BS, drs + vacated[i], run) != 0) goto out;
+                i += run;
+            }
+            for (size_t i = 0; i < vacancies; i++) occ[vacated[i]] = NONE;
+            for (size_t i = 0; i < evictions; i++) {
+                uint32_t id = occ[evict[i]];
+                cur[id] = vacated[i];
+                occ[vacated[i]] = id;
+            }
+        }
+
+        // Point the window's pointer blocks at the new places
+        for (uint64_t t = t0; t < t1; t++) {
+            if (!d->is_map[d->source[t]]) continue;
+            uint32_t* ptr = (uint32_t*)(buf + (t - t0) * BS);
+            for (size_t i = 0; i < PTRS_PER_BLOCK; i++) {
+                if (ptr[i] != 0) ptr[i] = remap(d, ptr[i]);
+            }
+        }
+
+        // Write the window back; in place, only the runs that changed
+        for (uint64_t t = t0; t < t1; ) {
+            size_t run = 1;
+            if (in_place) {
+                int same = cur[d->source[t]] == t && !d->is_map[d->source[t]];
+                while (t + run < t1 &&
+                       (cur[d->source[t + run]] == t + run && !d->is_map[d->source[t + run]]) == same) {
+                    run++;
+                }
+                if (same) {
+                    t += run;
+                    continue;
+                }
+            } else {
+                run = t1 - t;
+            }
+            if (write_blocks(out_fd, buf + (t - t0) * BS, drs + t, run) != 0) goto out;
+            t += run;
+        }
+        for (uint64_t t = t0; in_place && t < t1; t++) {
+            cur[d->source[t]] = (uint32_t)t;
+            occ[t] = d->source[t];
+        }
+    }
+    rc = 0;
+
+out:
+    free(buf);
+    free(evict_buf);
+    free(cur);
+    free(occ);
+    free(evict);
+    free(vacated);
+    return rc;
+}
+
+// Write the blocks of "meta" that differ from "ref" (the image as it is on
+// disk, or NULL for a new, all-zero file), adjacent ones together
+static int write_meta(int fd, const uint8_t* meta, const uint8_t* ref, uint64_t blocks) {
+    static const uint8_t zero[BS];
+    for (uint64_t b = 0; b < blocks; ) {
+        size_t run = 0;
+        while (b + run < blocks && memcmp(meta + (b + run) * BS, ref ? ref + (b + run) * BS : zero, BS) != 0) {
+            run++;
+        }
+        if (run == 0) {
+            b++;
+            continue;
+        }
+        if (write_blocks(fd, block_ptr(meta, b), b, run) != 0) return -1;
+        b += run;
+    }
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    const char* usage = "Usage: %s --image <file> [--output <file>] [--shrink] [--dry-run]\n";
+    const char* image_file = NULL;
+    const char* output_file = NULL;
+    int shrink = 0;
+    int dry_run = 0;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--image") == 0 && i + 1 < argc) {
+            image_file = argv[++i];
+        } else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+            output_file = argv[++i];
+        } else if (strcmp(argv[i], "--shrink") == 0) {
+            shrink = 1;
+        } else if (strcmp(argv[i], "--dry-run") == 0) {
+            dry_run = 1;
+        } else {
+            fprintf(stderr, usage, argv[0]);
+            return 1;
+        }
+    }
+    if (!image_file) {
+        fprintf(stderr, usage, argv[0]);
+        return 1;
+    }
+    int in_place = !output_file && !dry_run;
+
+    int fd = open(image_file, in_place ? O_RDWR : O_RDONLY);
+    if (fd < 0) {
+        perror("open image");
+        return 1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < (off_t)BS) {
+        fprintf(stderr, "Error: image too small\n");
+        close(fd);
+        return 1;
+    }
+    void* base = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        perror("mmap image");
+        close(fd);
+        return 1;
+    }
+
+    defrag_t d = { .base = base, .size = st.st_size, .sb = base };
+    const superblock_t* sb = d.sb;
+    if (!superblock_layout_ok(sb, d.size / BS) || sb->data_region_blocks >= NONE) {
+        fprintf(stderr, "Error: not a MiniVSFS image or layout out of range\n");
+        munmap(base, d.size);
+        close(fd);
+        return 1;
+    }
+    uint8_t* meta = malloc(block_offset(sb->data_region_start));
+    if (!meta) {
+        perror("malloc");
+        munmap(base, d.size);
+        close(fd);
+        return 1;
+    }
+    memcpy(meta, base, block_offset(sb->data_region_start));
+    superblock_t* msb = (superblock_t*)meta;
+    if (superblock_crc(meta) != sb->checksum || (sb->flags & ~SB_KNOWN_FLAGS)) {
+        fprintf(stderr, "Error: superblock CRC mismatch or unknown flags\n");
+        free(meta);
+        munmap(base, d.size);
+        close(fd);
+        return 1;
+    }
+
+    // Moving blocks under a transaction that still has to be replayed would
+    // replay it over the wrong blocks
+    if (sb->flags & SB_FLAG_JOURNAL) {
+        const journal_header_t* jh = (const journal_header_t*)block_ptr(d.base, sb->journal_start);
+        if (jh->magic == JOURNAL_MAGIC && jh->count != 0) {
+            fprintf(stderr, "Error: the journal holds a transaction (mkfs_adder replays it the next "
+                            "time it opens the image)\n");
+            free(meta);
+            munmap(base, d.size);
+            close(fd);
+            return 1;
+        }
+    }
+
+    d.inode_table = (const inode_t*)block_ptr(d.base, sb->inode_table_start);
+    d.inode_bitmap = block_ptr(d.base, sb->inode_bitmap_start);
+    d.data_bitmap = block_ptr(d.base, sb->data_bitmap_start);
+    uint64_t n = sb->data_region_blocks;
+    d.target = malloc((n ? n : 1) * sizeof(uint32_t));
+    d.source = malloc((n ? n : 1) * sizeof(uint32_t));
+    d.is_map = calloc(n ? n : 1, 1);
+    d.seen = calloc(sb->inode_count + 1, 1);
+    d.queue = malloc(sb->inode_count * sizeof(uint32_t));
+    int rc = 1;
+    if (!d.target || !d.source || !d.is_map || !d.seen || !d.queue) {
+        perror("malloc");
+        goto out;
+    }
+    memset(d.target, 0xFF, n * sizeof(uint32_t));
+    if (!bit_set(d.inode_bitmap, ROOT_INO - 1) || d.inode_table[ROOT_INO - 1].mode != 0040000) {
+        fprintf(stderr, "Error: root inode missing or not a directory\n");
+        goto out;
+    }
+    if (plan(&d) != 0) goto out;
+
+    uint64_t to_move = 0;
+    for (uint64_t t = 0; t < d.used; t++) to_move += d.source[t] != t;
+    printf("Plan: %" PRIu64 " file(s), %" PRIu64 " directory(ies), %" PRIu64 " of %" PRIu64
+           " block(s) in use\n", d.files, d.dirs, d.used, n);
+    printf("  %" PRIu64 " extent(s) before, %" PRIu64 " after\n", d.extents_before, d.extents_after);
+    printf("  %" PRIu64 " block(s) to move\n", to_move);
+    if (dry_run) {
+        rc = 0;
+        goto out;
+    }
+
+    // New inode pointers and CRCs, a data bitmap with one used prefix and,
+    // with --shrink, a data region that ends with it
+    inode_t* inodes = (inode_t*)block_ptr(meta, sb->inode_table_start);
+    for (uint64_t i = 0; i < sb->inode_count; i++) {
+        if (!bit_set(d.inode_bitmap, i)) continue;
+        inode_t* inode = &inodes[i];
+        inode_t old = *inode;
+        for (int k = 0; k < DIRECT_MAX; k++) {
+            if (inode->direct[k] != 0) inode->direct[k] = remap(&d, inode->direct[k]);
+        }
+        if (inode->indirect != 0) inode->indirect = remap(&d, inode->indirect);
+        if (inode->double_indirect != 0) inode->double_indirect = remap(&d, inode->double_indirect);
+        if (memcmp(&old, inode, sizeof(old)) != 0) inode_crc_finalize(inode);
+    }
+    uint8_t* bitmap = block_ptr(meta, sb->data_bitmap_start);
+    memset(bitmap, 0, sb->data_bitmap_blocks * BS);
+    memset(bitmap, 0xFF, d.used / 8);
+    if (d.used % 8) bitmap[d.used / 8] = (uint8_t)((1u << (d.used % 8)) - 1);
+    if (shrink) {
+        msb->data_region_blocks = d.used;
+        msb->total_blocks = sb->data_region_start + d.used;
+        superblock_crc_finalize(msb);
+    }
+
+    int out_fd = fd;
+    if (output_file) {
+        out_fd = open(output_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0) {
+            perror("open output");
+            goto out;
+        }
+        if (ftruncate(out_fd, (off_t)block_offset(msb->total_blocks)) != 0) {
+            perror("ftruncate");
+            close(out_fd);
+            goto out;
+        }
+    }
+
+    // Data first, then the metadata that points at it
+    uint64_t moved = 0, batches = 0;
+    int failed = move_blocks(&d, fd, out_fd, &moved, &batches) != 0 || fdatasync(out_fd) != 0 ||
+                 write_meta(out_fd, meta, output_file ? NULL : d.base, sb->data_region_start) != 0 ||
+                 fdatasync(out_fd) != 0;
+    if (!failed && in_place) {
+        off_t tail = (off_t)block_offset(sb->data_region_start + d.used);
+        if (shrink) {
+            failed = ftruncate(fd, tail) != 0;
+        } else if (block_offset(sb->total_blocks) > (uint64_t)tail) {
+            // Unused blocks read back as zeros and take no space; not every
+            // file system can do this, and the image is fine either way
+            fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, tail, block_offset(sb->total_blocks) - tail);
+        }
+    }
+    if (output_file) close(out_fd);
+    if (failed) {
+        fprintf(stderr, "Error writing %s\n", output_file ? output_file : image_file);
+        goto out;
+    }
+
+    printf("Moved %" PRIu64 " block(s) in %" PRIu64 " batch(es)\n", moved, batches);
+    if (msb->data_region_blocks > d.used) {
+        printf("Free space: %" PRIu64 " block(s) in one run at block %" PRIu64 "\n",
+               msb->data_region_blocks - d.used, sb->data_region_start + d.used);
+    }
+    if (shrink) {
+        printf("Shrunk image to %" PRIu64 " block(s) (%" PRIu64 " bytes)\n",
+               msb->total_blocks, block_offset(msb->total_blocks));
+    }
+    rc = 0;
+
+out:
+    free(d.target);
+    free(d.source);
+    free(d.is_map);
+    free(d.seen);
+    free(d.queue);
+    free(meta);
+    munmap(base, d.size);
+    close(fd);
+    return rc;
+}
@@ -0,0 +1,235 @@
+#!/bin/sh
+# Regression checks for the MiniVSFS tools: builds them with the same flags
+# as their Build: lines, runs each case on a fresh image in a temporary
+# directory and prints one ok/FAIL line per check.
+#
+# Usage: ./test_tools.sh
+# Exit status: 0 if every check passed, 1 otherwise.
+set -eu
+
+cd "$(dirname "$0")"
+
+tmp=$(mktemp -d)
+trap 'rm -rf "$tmp"' EXIT INT TERM
+
+gcc -O2 -std=c17 -Wall -Wextra mkfs_builder.c -o "$tmp/mkfs_builder"
+gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_adder.c -o "$tmp/mkfs_adder"
+gcc -O2 -std=c17 -Wall -Wextra -pthread mkfs_check.c -o "$tmp/mkfs_check"
+gcc -O2 -std=c17 -Wall -Wextra mkfs_defrag.c -o "$tmp/mkfs_defrag"
+
+# sb_poke <image> <field> <value> [valid]: overwrite a 64-bit superblock
+# field, and with "valid" recompute the checksum so only the layout is wrong
+cat > "$tmp/sb_poke.c" << 'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "minivsfs_format.h"
+
+int main(int argc, char** argv) {
+    static const struct { const char* name; size_t offset; } fields[] = {
+        { "inode_bitmap_start", offsetof(superblock_t, inode_bitmap_start) },
+        { "data_bitmap_start", offsetof(superblock_t, data_bitmap_start) },
+        { "inode_table_start", offsetof(superblock_t, inode_table_start) },
+        { "mtime_epoch", offsetof(superblock_t, mtime_epoch) },
+    };
+    uint8_t block[BS];
+    FILE* f = argc >= 4 ? fopen(argv[1], "r+b") : NULL;
+    if (!f || fread(block, BS, 1, f) != 1) return 2;
+    size_t k = 0;
+    while (k < sizeof(fields) / sizeof(fields[0]) && strcmp(fields[k].name, argv[2]) != 0) k++;
+    if (k == sizeof(fields) / sizeof(fields[0])) return 2;
+    uint64_t v = strtoull(argv[3], NULL, 10);
+    memcpy(block + fields[k].offset, &v, sizeof(v));
+    if (argc > 4 && strcmp(argv[4], "valid") == 0) superblock_crc_finalize((superblock_t*)block);
+    return fseek(f, 0, SEEK_SET) != 0 || fwrite(block, BS, 1, f) != 1 || fclose(f) != 0 ? 2 : 0;
+}
+EOF
+gcc -O2 -std=c17 -Wall -Wextra -I. "$tmp/sb_poke.c" -o "$tmp/sb_poke"
+
+# mvfs_cat <image> <name>: a file's contents through libminivsfs
+cat > "$tmp/mvfs_cat.c" << 'EOF'
+#include <stdio.h>
+#include "minivsfs.h"
+
+int main(int argc, char** argv) {
+    static char buf[1 << 16];
+    mvfs_image_t* img;
+    uint32_t ino;
+    if (argc != 3 || mvfs_open(argv[1], &img) != 0 || mvfs_lookup(img, argv[2], &ino) != 0) return 2;
+    ssize_t n;
+    for (uint64_t off = 0; (n = mvfs_pread(img, ino, buf, sizeof(buf), off)) > 0; off += n) {
+        fwrite(buf, 1, n, stdout);
+    }
+    mvfs_close(img);
+    return n < 0 ? 2 : 0;
+}
+EOF
+gcc -O2 -std=c17 -Wall -Wextra -I. "$tmp/mvfs_cat.c" minivsfs.c -o "$tmp/mvfs_cat"
+
+# LD_PRELOAD shim: the FAIL_FDATASYNC'th fdatasync() fails with EIO, and
+# the process stops there as a crash at that point would
+cat > "$tmp/fail_sync.c" << 'EOF'
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+int fdatasync(int fd) {
+    static int calls;
+    const char* n = getenv("FAIL_FDATASYNC");
+    if (n && ++calls == atoi(n)) {
+        errno = EIO;
+        return -1;
+    }
+    return (int)syscall(SYS_fdatasync, fd);
+}
+EOF
+gcc -O2 -std=c17 -Wall -Wextra -shared -fPIC "$tmp/fail_sync.c" -o "$tmp/fail_sync.so"
+
+failures=0
+ok() { printf 'ok    %s\n' "$1"; }
+fail() {
+    printf 'FAIL  %s\n' "$1"
+    failures=$((failures + 1))
+}
+
+# expect <status> <name> <command ...>: the command must exit with <status>;
+# its output is shown when it does not
+expect() {
+    want=$1 name=$2
+    shift 2
+    if "$@" > "$tmp/out" 2>&1; then got=0; else got=$?; fi
+    if [ "$got" -eq "$want" ]; then
+        ok "$name"
+    else
+        fail "$name: exit $got, expected $want"
+        sed 's/^/      /' "$tmp/out"
+    fi
+}
+
+# expect_output <pattern> <name>: the last expect's output must match
+expect_output() {
+    if grep -q "$1" "$tmp/out"; then ok "$2"; else fail "$2"; fi
+}
+
+# build [mkfs_builder options]: a fresh 8 MiB image in $tmp/t.img
+build() {
+    "$tmp/mkfs_builder" --image "$tmp/t.img" --size-kib 8192 --inodes 128 --epoch 0 "$@" > /dev/null
+}
+
+# adder <mkfs_adder options>: run from $tmp, so files are named as in $tmp
+adder() {
+    (cd "$tmp" && ./mkfs_adder "$@")
+}
+
+# adder_failing_sync <n> <mkfs_adder options>: adder with its n'th
+# fdatasync() failing
+adder_failing_sync() {
+    n=$1
+    shift
+    (cd "$tmp" && LD_PRELOAD="$tmp/fail_sync.so" FAIL_FDATASYNC=$n ./mkfs_adder "$@")
+}
+
+# readback <name> <image> <file ...>: each file must read back from the
+# image byte for byte as it is in $tmp
+readback() {
+    name=$1 img=$2
+    shift 2
+    for f in "$@"; do
+        if ! "$tmp/mvfs_cat" "$img" "$f" | cmp -s - "$tmp/$f"; then
+            fail "$name: $f differs"
+            return
+        fi
+    done
+    ok "$name"
+}
+
+# Test files from empty to past the single-indirect map
+for spec in "f0 0" "f1 1" "f2 5000" "f3 49152" "f4 300000" "f5 4300000"; do
+    # shellcheck disable=SC2086
+    set -- $spec
+    head -c "$2" /dev/urandom > "$tmp/$1"
+done
+
+# mkfs_check: a corrupt superblock is reported, never crashed on. Layout
+# fields out of range stop the check (2) whether or not the CRC matches; a
+# CRC mismatch alone is an error (1).
+build
+expect 0 "check: fresh image is clean" "$tmp/mkfs_check" --image "$tmp/t.img"
+for c in "inode_table_start stale 2" "inode_bitmap_start valid 2" "data_bitmap_start valid 2" "mtime_epoch stale 1"; do
+    # shellcheck disable=SC2086
+    set -- $c
+    build
+    "$tmp/sb_poke" "$tmp/t.img" "$1" 1000000000 "$2"
+    expect "$3" "check: bad $1, $2 CRC" "$tmp/mkfs_check" --image "$tmp/t.img"
+done
+
+# Journal: when an add's commit fails after the header is synced, the
+# transaction stays pending (mkfs_check exits 3) until the next mkfs_adder
+# run replays it, leaving every file intact
+build --journal-blocks 64
+expect 0 "journal: in-place add" adder --input t.img --in-place --file f1 --file f2 --file f3
+expect 0 "journal: check after add" "$tmp/mkfs_check" --image "$tmp/t.img"
+readback "journal: read back" "$tmp/t.img" f1 f2 f3
+# fdatasync 1 syncs the data and log, 2 the header, 3 the checkpoint
+expect 1 "journal: add with the checkpoint sync failing" \
+    adder_failing_sync 3 --input t.img --in-place --file f4
+expect 3 "journal: check sees the pending transaction" "$tmp/mkfs_check" --image "$tmp/t.img"
+expect 0 "journal: next add replays it" adder --input t.img --in-place --file f0
+expect 0 "journal: check after replay" "$tmp/mkfs_check" --image "$tmp/t.img"
+readback "journal: read back after replay" "$tmp/t.img" f0 f1 f2 f3 f4
+
+# --remove under --dedup: removing one of two files that share blocks
+# keeps them for the other; removing both frees them for the next add
+cp "$tmp/f3" "$tmp/d3"
+cp "$tmp/f4" "$tmp/d4"
+for journal in "" "--journal-blocks 64"; do
+    mode=${journal:+journaled }remove
+    # shellcheck disable=SC2086
+    build $journal
+    expect 0 "$mode: dedup add" adder --input t.img --in-place --dedup \
+        --file f2 --file f3 --file f4 --file d3 --file d4
+    expect 0 "$mode: remove one copy" adder --input t.img --in-place --dedup --remove f3 --remove f4
+    expect_output "still shared" "$mode: blocks were shared"
+    expect 0 "$mode: check after remove" "$tmp/mkfs_check" --image "$tmp/t.img"
+    readback "$mode: shared blocks kept" "$tmp/t.img" f2 d3 d4
+    expect 0 "$mode: remove the other, add into the freed blocks" \
+        adder --input t.img --in-place --dedup --remove d3 --remove d4 --file f5
+    expect 0 "$mode: check after reuse" "$tmp/mkfs_check" --image "$tmp/t.img"
+    readback "$mode: read back after reuse" "$tmp/t.img" f2 f5
+done
+
+# mkfs_defrag: compacts an image fragmented by removes, in place and into
+# a shrunk --output copy, and a second run has nothing to move
+for journal in "" "--journal-blocks 64"; do
+    mode=${journal:+journaled }defrag
+    # shellcheck disable=SC2086
+    build $journal
+    expect 0 "$mode: add" adder --input t.img --in-place --file f1 --file f2 --file f3 --file f4
+    expect 0 "$mode: remove to leave holes" adder --input t.img --in-place --remove f1 --remove f3 --file f5
+    expect 0 "$mode: --output --shrink" "$tmp/mkfs_defrag" --image "$tmp/t.img" \
+        --output "$tmp/s.img" --shrink
+    expect 0 "$mode: check shrunk copy" "$tmp/mkfs_check" --image "$tmp/s.img"
+    readback "$mode: read back shrunk copy" "$tmp/s.img" f2 f4 f5
+    if [ "$(wc -c < "$tmp/s.img")" -lt "$(wc -c < "$tmp/t.img")" ]; then
+        ok "$mode: copy is smaller"
+    else
+        fail "$mode: copy is smaller"
+    fi
+    expect 0 "$mode: in place" "$tmp/mkfs_defrag" --image "$tmp/t.img"
+    expect_output "^Moved [1-9]" "$mode: blocks moved"
+    expect 0 "$mode: check after defrag" "$tmp/mkfs_check" --image "$tmp/t.img"
+    readback "$mode: read back after defrag" "$tmp/t.img" f2 f4 f5
+    expect 0 "$mode: second run" "$tmp/mkfs_defrag" --image "$tmp/t.img"
+    expect_output "^  0 block(s) to move" "$mode: nothing left to move"
+done
+build
+"$tmp/sb_poke" "$tmp/t.img" inode_table_start 1000000000 valid
+expect 1 "defrag: refuses a bad layout with a valid CRC" "$tmp/mkfs_defrag" --image "$tmp/t.img"
+
+if [ "$failures" -ne 0 ]; then
+    echo "$failures check(s) failed"
+    exit 1
+fi
+echo "All checks passed"